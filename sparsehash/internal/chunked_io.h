@@ -0,0 +1,237 @@
+// Copyright (c) 2006, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// ---
+//
+// The chunked serialization format of the hashtables (see
+// parallel_serialize()) splits a table into chunks of buckets, or of
+// groups for sparse tables, which threads write and read at once with
+// pwrite() and pread().  A file in this format is:
+//
+//   the table's header: a magic number and what the table needs to
+//       know before reading any chunk, such as its bucket count
+//   the number of chunks, as an 8-byte big-endian number
+//   for each chunk, where it starts in the file and how long it is,
+//       also 8-byte big-endian numbers
+//   the chunks, each serialized the same way as the buckets it covers
+//       would be by serialize()
+//
+// This file has the parts that both kinds of table share: in-memory
+// streams to serialize a chunk into and out of, and the code that
+// writes and reads the index and the chunks.  It needs pread() and
+// pwrite(), so on Windows reading and writing just fail.
+
+#pragma once
+
+#include <assert.h>
+#include <stddef.h>    // for size_t
+#include <stdint.h>    // for uint64_t
+#include <string.h>    // for memcpy
+#include <atomic>
+#include <vector>
+#include <sparsehash/internal/hashtable-common.h>
+#ifndef _WIN32
+#include <errno.h>
+#include <unistd.h>    // for pread, pwrite
+#endif
+
+namespace google {
+namespace sparsehash_internal {
+
+// A custom OUTPUT (see hashtable-common.h) that collects what's
+// written.  flush() and stream() make it look like a buffered_writer
+// to the tables, which then hand it straight to their serializer.
+class memory_output {
+ public:
+  size_t Write(const void* data, size_t length) {
+    const char* p = static_cast<const char*>(data);
+    data_.insert(data_.end(), p, p + length);
+    return length;
+  }
+  bool flush() { return true; }
+  memory_output* stream() { return this; }
+
+  const char* data() const { return data_.empty() ? NULL : &data_[0]; }
+  size_t size() const { return data_.size(); }
+
+ private:
+  std::vector<char> data_;
+};
+
+// A custom INPUT that reads what's in [data, data + length).
+class memory_input {
+ public:
+  memory_input(const char* data, size_t length)
+      : data_(data), remaining_(length) {}
+
+  size_t Read(void* data, size_t length) {
+    if (length > remaining_) length = remaining_;
+    if (length > 0) memcpy(data, data_, length);
+    data_ += length;
+    remaining_ -= length;
+    return length;
+  }
+  memory_input* stream() { return this; }
+
+  size_t remaining() const { return remaining_; }
+
+ private:
+  const char* data_;
+  size_t remaining_;
+};
+
+// pwrite() and pread() all of [data, data + length), or return false.
+inline bool pwrite_all(int fd, const void* data, size_t length,
+                       uint64_t offset) {
+#ifndef _WIN32
+  const char* p = static_cast<const char*>(data);
+  while (length > 0) {
+    const ssize_t n = pwrite(fd, p, length, static_cast<off_t>(offset));
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    p += n;
+    length -= n;
+    offset += n;
+  }
+  return true;
+#else
+  (void)fd, (void)data, (void)offset;
+  return length == 0;
+#endif
+}
+
+inline bool pread_all(int fd, void* data, size_t length, uint64_t offset) {
+#ifndef _WIN32
+  char* p = static_cast<char*>(data);
+  while (length > 0) {
+    const ssize_t n = pread(fd, p, length, static_cast<off_t>(offset));
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;  // 0 means the file is too short
+    p += n;
+    length -= n;
+    offset += n;
+  }
+  return true;
+#else
+  (void)fd, (void)data, (void)offset;
+  return length == 0;
+#endif
+}
+
+// How many chunks write_chunked() keeps in memory at once.
+static const size_t CHUNKS_IN_FLIGHT = 64;
+
+// Writes the file: header, which the table has filled in, then the
+// index, then the chunks.  write_chunk(c, &out) serializes chunk c into
+// the memory_output out, and returns false if it can't.  The chunks are
+// serialized CHUNKS_IN_FLIGHT at a time in parallel on run, and then
+// written in parallel, so we never hold more than that many in memory.
+// The index goes in last, once we know where every chunk went.
+template <class Run, class WriteChunk>
+bool write_chunked(Run& run, int fd, const memory_output& header,
+                   size_t num_chunks, WriteChunk write_chunk) {
+  std::vector<uint64_t> index(2 * num_chunks);  // offset, length
+  uint64_t offset = header.size() + 8 + 16 * uint64_t(num_chunks);
+  std::atomic<bool> ok(true);
+  for (size_t first = 0; first < num_chunks; first += CHUNKS_IN_FLIGHT) {
+    const size_t n = num_chunks - first < CHUNKS_IN_FLIGHT
+                         ? num_chunks - first
+                         : CHUNKS_IN_FLIGHT;
+    std::vector<memory_output> chunks(n);
+    run(n, [&](size_t i) {
+      if (!write_chunk(first + i, &chunks[i])) ok = false;
+    });
+    if (!ok) return false;
+    for (size_t i = 0; i < n; ++i) {
+      index[2 * (first + i)] = offset;
+      index[2 * (first + i) + 1] = chunks[i].size();
+      offset += chunks[i].size();
+    }
+    run(n, [&](size_t i) {
+      if (!pwrite_all(fd, chunks[i].data(), chunks[i].size(),
+                      index[2 * (first + i)]))
+        ok = false;
+    });
+    if (!ok) return false;
+  }
+  memory_output head(header);
+  write_bigendian_number(&head, uint64_t(num_chunks), 8);
+  for (size_t i = 0; i < index.size(); ++i)
+    write_bigendian_number(&head, index[i], 8);
+  return pwrite_all(fd, head.data(), head.size(), 0);
+}
+
+// Reads header_length bytes of header from the start of the file.
+inline bool read_chunked_header(int fd, size_t header_length,
+                                std::vector<char>* header) {
+  header->resize(header_length);
+  return pread_all(fd, &(*header)[0], header_length, 0);
+}
+
+// Reads the index that follows the header, which must list num_chunks
+// chunks, and then the chunks, in parallel on run: each task reads its
+// chunk into memory with one pread(), and read_chunk(c, &in) parses it
+// from the memory_input in.  It fails unless every read_chunk() returns
+// true having used up all of its chunk.
+template <class Run, class ReadChunk>
+bool read_chunked(Run& run, int fd, size_t header_length, size_t num_chunks,
+                  ReadChunk read_chunk) {
+  std::vector<char> raw(8 + 16 * num_chunks);
+  if (!pread_all(fd, &raw[0], raw.size(), header_length)) return false;
+  memory_input in(&raw[0], raw.size());
+  uint64_t chunks_read = 0;
+  if (!read_bigendian_number(&in, &chunks_read, 8) ||
+      chunks_read != num_chunks)
+    return false;
+  std::vector<uint64_t> index(2 * num_chunks);  // offset, length
+  for (size_t i = 0; i < index.size(); ++i)
+    if (!read_bigendian_number(&in, &index[i], 8)) return false;
+
+  std::atomic<bool> ok(true);
+  run(num_chunks, [&](size_t c) {
+    if (!ok) return;
+    const uint64_t length = index[2 * c + 1];
+    if (length > static_cast<size_t>(-1)) {
+      ok = false;
+      return;
+    }
+    std::vector<char> chunk(static_cast<size_t>(length));
+    if (!pread_all(fd, chunk.empty() ? NULL : &chunk[0], chunk.size(),
+                   index[2 * c])) {
+      ok = false;
+      return;
+    }
+    memory_input chunk_in(chunk.empty() ? NULL : &chunk[0], chunk.size());
+    if (!read_chunk(c, &chunk_in) || chunk_in.remaining() != 0) ok = false;
+  });
+  return ok;
+}
+
+}  // namespace sparsehash_internal
+}  // namespace google
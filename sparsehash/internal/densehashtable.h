@@ -41,6 +41,17 @@
 // the hashtable is insert_only until you set it again.  The empty
 // value however can't be changed.)
 //
+// If dense_split_keys<Value> is true, we also keep a copy of each
+// bucket's key in an array parallel to the table, and probe that
+// instead.  A probe then only touches the bucket itself on a match.
+//
+// If no empty key is ever set, we instead keep a side array with two
+// bits of state (empty, occupied or deleted) per bucket.  Empty and
+// deleted buckets then hold raw, unconstructed storage, no key value
+// is reserved, and erase() works without a deleted key.  The table is
+// allocated lazily, on first insert, so set_empty_key() must still be
+// called before that if you want the sentinel representation.
+//
 // To minimize allocation and pointer overhead, we use internal
 // probing, in which the hashtable is a single table, and collisions
 // are resolved by trying to insert again in another bucket.  The
@@ -71,7 +82,10 @@
 // For enlarge_factor, you can use this chart to try to trade-off
 // expected lookup time to the space taken up.  By default, this
 // code uses quadratic probing, though you can change it to linear
-// via JUMP_ below if you really want to.
+// via JUMP_ below if you really want to.  (Tables with fine-grained
+// bucket counts, see set_fine_grained_buckets(), always probe linearly,
+// since quadratic probing only reaches every bucket when the bucket
+// count is a power of two.)
 //
 // From
 // http://www.augustana.ca/~mohrj/courses/1999.fall/csc210/lecture_notes/hashing.html
@@ -91,6 +105,7 @@
 
 #include <assert.h>
 #include <stdio.h>    // for FILE, fwrite, fread
+#include <stdint.h>   // for uint64_t
 #include <algorithm>  // For swap(), eg
 #include <iterator>   // For iterator tags
 #include <limits>     // for numeric_limits
@@ -99,8 +114,12 @@
 #include <stdexcept>  // For length_error
 #include <tuple>      // For forward_as_tuple
 #include <type_traits>
+#include <vector>     // for parallel_reduce()'s partial results
+#include <sparsehash/internal/chunked_io.h>
 #include <sparsehash/internal/hashtable-common.h>
 #include <sparsehash/internal/libc_allocator_with_realloc.h>
+#include <sparsehash/internal/thread_executor.h>
+#include <sparsehash/traits>
 
 namespace google {
 
@@ -174,6 +193,10 @@ struct dense_hashtable_iterator {
   // Arithmetic.  The only hard part is making sure that
   // we're not on an empty or marked-deleted array element
   void advance_past_empty_and_deleted() {
+    if (ht->use_state_bitmap()) {  // we can skip many buckets at a time
+      pos = ht->skip_to_occupied(pos, end);
+      return;
+    }
     while (pos != end && (ht->test_empty(*this) || ht->test_deleted(*this)))
       ++pos;
   }
@@ -238,6 +261,10 @@ struct dense_hashtable_const_iterator {
   // Arithmetic.  The only hard part is making sure that
   // we're not on an empty or marked-deleted array element
   void advance_past_empty_and_deleted() {
+    if (ht->use_state_bitmap()) {  // we can skip many buckets at a time
+      pos = ht->skip_to_occupied(pos, end);
+      return;
+    }
     while (pos != end && (ht->test_empty(*this) || ht->test_deleted(*this)))
       ++pos;
   }
@@ -268,6 +295,11 @@ class dense_hashtable {
  private:
   using value_alloc_type =
       typename std::allocator_traits<Alloc>::template rebind_alloc<Value>;
+  using state_alloc_type =
+      typename std::allocator_traits<Alloc>::template rebind_alloc<uint64_t>;
+  using mutable_key_type = typename std::remove_const<Key>::type;
+  using key_alloc_type = typename std::allocator_traits<
+      Alloc>::template rebind_alloc<mutable_key_type>;
 
  public:
   typedef Key key_type;
@@ -313,16 +345,20 @@ class dense_hashtable {
   // at least HT_MIN_BUCKETS.
   static const size_type HT_DEFAULT_STARTING_BUCKETS = 32;
 
+  // Whether we keep the keys in an array of their own, as well.
+  static const bool split_keys = dense_split_keys<Value>::value;
+  static_assert(!split_keys ||
+                    std::is_trivially_copyable<mutable_key_type>::value,
+                "dense_split_keys needs a trivially copyable key type");
+
   // ITERATOR FUNCTIONS
-  iterator begin() { return iterator(this, table, table + num_buckets, true); }
-  iterator end() {
-    return iterator(this, table + num_buckets, table + num_buckets, true);
-  }
+  iterator begin() { return iterator(this, table, table_end(), true); }
+  iterator end() { return iterator(this, table_end(), table_end(), true); }
   const_iterator begin() const {
-    return const_iterator(this, table, table + num_buckets, true);
+    return const_iterator(this, table, table_end(), true);
   }
   const_iterator end() const {
-    return const_iterator(this, table + num_buckets, table + num_buckets, true);
+    return const_iterator(this, table_end(), table_end(), true);
   }
 
   // These come from tr1 unordered_map.  They iterate over 'bucket' n.
@@ -351,6 +387,34 @@ class dense_hashtable {
 
   // Accessor function for statistics gathering.
   int num_table_copies() const { return settings.num_ht_copies(); }
+#ifdef SPARSEHASH_COLLECT_STATS
+  hashtable_counters counters() const { return settings.counters(); }
+  void reset_counters() { settings.reset_counters(); }
+#endif
+
+  // Walks every bucket to see how crowded the table is; see
+  // hashtable_stats in hashtable-common.h.
+  hashtable_stats compute_stats() const {
+    sparsehash_internal::stats_scanner scanner;
+    for (size_type i = 0; i < num_buckets; ++i) {
+      if (test_empty(i)) {
+        scanner.empty_bucket();
+      } else if (test_deleted(i)) {
+        scanner.deleted_bucket();
+      } else {
+        // Retrace find()'s probes, without comparing keys.
+        size_type num_probes = 0;
+        for (size_type bucknum = first_bucket(hash(get_key(table[i])));
+             bucknum != i; bucknum = next_bucket(bucknum, num_probes)) {
+          ++num_probes;
+          assert(num_probes < bucket_count());
+        }
+        scanner.element(num_probes);
+      }
+    }
+    return scanner.finish(num_elements - num_deleted, num_buckets,
+                          num_deleted);
+  }
 
  private:
   // Annoyingly, we can't copy values around, because they might have
@@ -364,9 +428,114 @@ class dense_hashtable {
   }
 
   void destroy_buckets(size_type first, size_type last) {
+    if (use_state_bitmap()) {  // only occupied buckets hold a value
+      for (; first != last; ++first)
+        if (get_state(first) == BUCKET_OCCUPIED) table[first].~value_type();
+      return;
+    }
     for (; first != last; ++first) table[first].~value_type();
   }
 
+  // Puts a new value into an empty or deleted bucket.
+  template <typename... Args>
+  void fill_bucket(size_type bucknum, Args&&... args) {
+    if (use_state_bitmap()) {  // the bucket is raw storage
+      new (&table[bucknum]) value_type(std::forward<Args>(args)...);
+      set_state(bucknum, BUCKET_OCCUPIED);
+    } else {
+      set_value(&table[bucknum], std::forward<Args>(args)...);
+    }
+    if (split_keys) keys[bucknum] = get_key(table[bucknum]);
+  }
+
+  // Compares key with the key in bucket bucknum, using the key array if
+  // we have one so we don't have to touch the bucket.
+  template <typename K>
+  bool bucket_key_equals(const K& key, size_type bucknum) const {
+    if (split_keys) return equals(key, keys[bucknum]);
+    return equals(key, get_key(table[bucknum]));
+  }
+
+  // Past-the-end pointer; the table may not be allocated yet.
+  pointer table_end() const { return table ? table + num_buckets : table; }
+
+  // The table is allocated on first insert when there is no empty key.
+  void ensure_table() {
+    if (!table) clear_to_size(num_buckets);
+  }
+
+  // BUCKET STATE HELPER FUNCTIONS
+  // Without an empty key, we keep two bits per bucket in a side array,
+  // 32 buckets to a word, saying whether the bucket is empty, occupied
+  // or deleted.  Only occupied buckets hold a constructed value.
+  enum { BUCKET_EMPTY = 0, BUCKET_OCCUPIED = 1, BUCKET_DELETED = 2 };
+
+  static size_type num_state_words(size_type n) { return (n + 31) / 32; }
+  state_alloc_type state_allocator() const {
+    return state_alloc_type(static_cast<const value_alloc_type&>(val_info));
+  }
+  key_alloc_type key_allocator() const {
+    return key_alloc_type(static_cast<const value_alloc_type&>(val_info));
+  }
+
+  // Allocates (or frees) the arrays we keep next to the table of n
+  // buckets, for whichever of the state bitmap and key array we use.
+  void allocate_side_arrays(size_type n) {
+    if (use_state_bitmap())
+      states = state_allocator().allocate(num_state_words(n));
+    if (split_keys) keys = key_allocator().allocate(n);
+  }
+  void deallocate_side_arrays(size_type n) {
+    if (states) state_allocator().deallocate(states, num_state_words(n));
+    if (keys) key_allocator().deallocate(keys, n);
+    states = NULL;
+    keys = NULL;
+  }
+  unsigned get_state(size_type bucknum) const {
+    return (states[bucknum / 32] >> (2 * (bucknum % 32))) & 3;
+  }
+  void set_state(size_type bucknum, unsigned state) {
+    const int shift = 2 * (bucknum % 32);
+    uint64_t& word = states[bucknum / 32];
+    word = (word & ~(uint64_t(3) << shift)) | (uint64_t(state) << shift);
+  }
+  // Destroys the value in an occupied bucket and marks it deleted.
+  // Returns true if the bucket was occupied.
+  bool mark_deleted(size_type bucknum) {
+    if (get_state(bucknum) != BUCKET_OCCUPIED) return false;
+    table[bucknum].~value_type();
+    set_state(bucknum, BUCKET_DELETED);
+    return true;
+  }
+
+ public:
+  // These are public so the iterators can use them
+  bool use_state_bitmap() const { return !settings.use_empty(); }
+
+  // Returns the first occupied bucket in [pos, last), or last if none.
+  // Only valid when use_state_bitmap() is true.
+  template <typename P>
+  P skip_to_occupied(P pos, P last) const {
+    if (pos == last) return last;
+    const P base = table;
+    size_type i = pos - base;
+    const size_type n = last - base;
+    // The low bit of each 2-bit state is set only for occupied buckets.
+    const uint64_t occupied_bits = 0x5555555555555555ULL;
+    while (i < n) {
+      const uint64_t bits =
+          (states[i / 32] & occupied_bits) >> (2 * (i % 32));
+      if (bits) {
+        i += sparsehash_internal::count_trailing_zeros64(bits) / 2;
+        return i < n ? base + i : last;
+      }
+      i = (i / 32 + 1) * 32;  // nothing more in this word
+    }
+    return last;
+  }
+
+ private:
+
   // DELETE HELPER FUNCTIONS
   // This lets the user describe a key that will indicate deleted
   // table entries.  This key should be an "impossible" entry --
@@ -378,8 +547,8 @@ class dense_hashtable {
     if (num_deleted) {             // get rid of deleted before writing
       size_type resize_to = settings.min_buckets(
           num_elements, bucket_count());
-      dense_hashtable tmp(std::move(*this), resize_to);  // copying will get rid of deleted
-      swap(tmp);                   // now we are tmp
+      // copying will get rid of deleted
+      rehash_to(resize_to, resize_event::SQUASH_DELETED);
     }
     assert(num_deleted == 0);
   }
@@ -391,6 +560,10 @@ class dense_hashtable {
     assert(num_deleted > 0);
     return equals(key_info.delkey, key);
   }
+  bool test_deleted_bucket(size_type bucknum) const {
+    assert(num_deleted > 0);
+    return bucket_key_equals(key_info.delkey, bucknum);
+  }
 
  public:
   void set_deleted_key(const key_type& key) {
@@ -417,16 +590,20 @@ class dense_hashtable {
   // These are public so the iterators can use them
   // True if the item at position bucknum is "deleted" marker
   bool test_deleted(size_type bucknum) const {
+    if (use_state_bitmap())
+      return num_deleted > 0 && get_state(bucknum) == BUCKET_DELETED;
     // Invariant: !use_deleted() implies num_deleted is 0.
     assert(settings.use_deleted() || num_deleted == 0);
-    return num_deleted > 0 && test_deleted_key(get_key(table[bucknum]));
+    return num_deleted > 0 && test_deleted_bucket(bucknum);
   }
   bool test_deleted(const iterator& it) const {
+    if (use_state_bitmap()) return test_deleted(it.pos - table);
     // Invariant: !use_deleted() implies num_deleted is 0.
     assert(settings.use_deleted() || num_deleted == 0);
     return num_deleted > 0 && test_deleted_key(get_key(*it));
   }
   bool test_deleted(const const_iterator& it) const {
+    if (use_state_bitmap()) return test_deleted(it.pos - table);
     // Invariant: !use_deleted() implies num_deleted is 0.
     assert(settings.use_deleted() || num_deleted == 0);
     return num_deleted > 0 && test_deleted_key(get_key(*it));
@@ -435,15 +612,18 @@ class dense_hashtable {
  private:
   void check_use_deleted(const char* caller) {
     (void)caller;  // could log it if the assert failed
-    assert(settings.use_deleted());
+    // The state bitmap doesn't need a deleted key.
+    assert(use_state_bitmap() || settings.use_deleted());
   }
 
   // Set it so test_deleted is true.  true if object didn't used to be deleted.
   bool set_deleted(iterator& it) {
     check_use_deleted("set_deleted()");
+    if (use_state_bitmap()) return mark_deleted(it.pos - table);
     bool retval = !test_deleted(it);
     // &* converts from iterator to value-type.
     set_key(&(*it), key_info.delkey);
+    if (split_keys) keys[it.pos - table] = key_info.delkey;
     return retval;
   }
   // Set it so test_deleted is false.  true if object used to be deleted.
@@ -460,8 +640,10 @@ class dense_hashtable {
   // really matter.
   bool set_deleted(const_iterator& it) {
     check_use_deleted("set_deleted()");
+    if (use_state_bitmap()) return mark_deleted(it.pos - table);
     bool retval = !test_deleted(it);
     set_key(const_cast<pointer>(&(*it)), key_info.delkey);
+    if (split_keys) keys[it.pos - table] = key_info.delkey;
     return retval;
   }
   // Set it so test_deleted is false.  true if object used to be deleted.
@@ -480,24 +662,34 @@ class dense_hashtable {
   // These are public so the iterators can use them
   // True if the item at position bucknum is "empty" marker
   bool test_empty(size_type bucknum) const {
-    assert(settings.use_empty());  // we always need to know what's empty!
-    return equals(key_info.empty_key, get_key(table[bucknum]));
+    if (use_state_bitmap())  // every bucket is empty until we allocate
+      return !states || get_state(bucknum) == BUCKET_EMPTY;
+    return bucket_key_equals(key_info.empty_key, bucknum);
   }
   bool test_empty(const iterator& it) const {
-    assert(settings.use_empty());  // we always need to know what's empty!
+    if (use_state_bitmap()) return test_empty(it.pos - table);
     return equals(key_info.empty_key, get_key(*it));
   }
   bool test_empty(const const_iterator& it) const {
-    assert(settings.use_empty());  // we always need to know what's empty!
+    if (use_state_bitmap()) return test_empty(it.pos - table);
     return equals(key_info.empty_key, get_key(*it));
   }
 
  private:
   void fill_range_with_empty(pointer table_start, size_type count) {
+    if (use_state_bitmap()) {  // empty buckets are left unconstructed
+      assert(table_start == table);
+      std::fill(states, states + num_state_words(count), uint64_t(0));
+      return;
+    }
     for (size_type i = 0; i < count; ++i)
     {
       construct_key(&table_start[i], key_info.empty_key);
     }
+    if (split_keys) {
+      assert(table_start == table);
+      std::fill(keys, keys + count, key_info.empty_key);
+    }
   }
 
  public:
@@ -516,6 +708,7 @@ class dense_hashtable {
     // num_buckets was set in constructor even though table was NULL
     table = val_info.allocate(num_buckets);
     assert(table);
+    allocate_side_arrays(num_buckets);
     fill_range_with_empty(table, num_buckets);
   }
   key_type empty_key() const {
@@ -546,7 +739,8 @@ class dense_hashtable {
   // done after shrinking.  Maybe make part of the Settings class?
   bool maybe_shrink() {
     assert(num_elements >= num_deleted);
-    assert((bucket_count() & (bucket_count() - 1)) == 0);  // is a power of two
+    assert(settings.fine_grained_buckets() ||
+           (bucket_count() & (bucket_count() - 1)) == 0);  // a power of two
     assert(bucket_count() >= HT_MIN_BUCKETS);
     bool retval = false;
 
@@ -563,10 +757,9 @@ class dense_hashtable {
       size_type sz = bucket_count() / 2;  // find how much we should shrink
       while (sz > HT_DEFAULT_STARTING_BUCKETS &&
              num_remain < sz * shrink_factor) {
-        sz /= 2;  // stay a power of 2
+        sz /= 2;  // stay a power of 2 (unless fine-grained; see min_buckets)
       }
-      dense_hashtable tmp(std::move(*this), sz);  // Do the actual resizing
-      swap(tmp);                       // now we are tmp
+      rehash_to(sz, resize_event::SHRINK);  // Do the actual resizing
       retval = true;
     }
     settings.set_consider_shrink(false);  // because we just considered it
@@ -578,14 +771,20 @@ class dense_hashtable {
   // Returns true if we actually resized, false if size was already ok.
   bool resize_delta(size_type delta) {
     bool did_resize = false;
-    if (settings.consider_shrink()) {  // see if lots of deletes happened
+    if (settings.reseed_pending()) {  // see set_seeded_hashing()
+      set_hash_seed(sparsehash_internal::random_hash_seed(this));
+      did_resize = true;
+    }
+    if (settings.consider_shrink() &&  // see if lots of deletes happened
+        settings.shrink_delay_passed()) {
       if (maybe_shrink()) did_resize = true;
     }
     if (num_elements >= (std::numeric_limits<size_type>::max)() - delta) {
       throw std::length_error("resize overflow");
     }
     if (bucket_count() >= HT_MIN_BUCKETS &&
-        (num_elements + delta) <= settings.enlarge_threshold())
+        (num_elements + delta) <= settings.enlarge_threshold() &&
+        !settings.grow_early())
       return did_resize;  // we're ok as we are
 
     // Sometimes, we need to resize just to get rid of all the
@@ -595,11 +794,21 @@ class dense_hashtable {
     // size to resize to, *don't* count deleted buckets, since they
     // get discarded during the resize.
     size_type needed_size = settings.min_buckets(num_elements + delta, 0);
-    if (needed_size <= bucket_count())  // we have enough buckets
+    if (settings.grow_early())  // an insert probed too long; see resize_policy
+      needed_size = settings.min_buckets(0, bucket_count() + 1);
+    // (Under a memory budget, needed_size may be too small after all.)
+    if (needed_size <= bucket_count() &&
+        num_elements + delta < bucket_count())  // we have enough buckets
       return did_resize;
 
     size_type resize_to = settings.min_buckets(
         num_elements - num_deleted + delta, bucket_count());
+    if (settings.grow_early() && resize_to < needed_size)
+      resize_to = needed_size;
+    if (num_elements - num_deleted + delta >= resize_to) {
+      // We'd need more buckets than the memory budget allows.
+      throw std::length_error("resize exceeds memory budget");
+    }
 
     // When num_deleted is large, we may still grow but we do not want to
     // over expand.  So we reduce needed_size by a portion of num_deleted
@@ -609,7 +818,8 @@ class dense_hashtable {
     needed_size = settings.min_buckets(num_elements - num_deleted / 4 + delta, 0);
 
     if (resize_to < needed_size &&  // may double resize_to
-        resize_to < (std::numeric_limits<size_type>::max)() / 2) {
+        resize_to < (std::numeric_limits<size_type>::max)() / 2 &&
+        !settings.at_budget(resize_to)) {
       // This situation means that we have enough deleted elements,
       // that once we purge them, we won't actually have needed to
       // grow.  But we may want to grow anyway: if we just purge one
@@ -617,18 +827,33 @@ class dense_hashtable {
       // insert.  Might as well grow now, since we're already going
       // through the trouble of copying (in order to purge the
       // deleted elements).
+      const size_type next = settings.grow_step(resize_to);
       const size_type target =
-          static_cast<size_type>(settings.shrink_size(resize_to * 2));
+          static_cast<size_type>(settings.shrink_size(next));
       if (num_elements - num_deleted + delta >= target) {
         // Good, we won't be below the shrink threshhold even if we double.
-        resize_to *= 2;
+        resize_to = next;
       }
     }
-    dense_hashtable tmp(std::move(*this), resize_to);
-    swap(tmp);  // now we are tmp
+    rehash_to(resize_to, resize_event::RESIZE);
     return true;
   }
 
+  // Moves everything into a new table of at least min_buckets_wanted
+  // buckets, which then becomes us.  This is the only place we rehash
+  // in place, so it tells the resize observer and the tracepoints.
+  void rehash_to(size_type min_buckets_wanted,
+                 resize_event::reason_type reason) {
+    const size_type old_buckets = bucket_count();
+    const uint64_t start = settings.rehash_begin(
+        this, reason, old_buckets,
+        settings.min_buckets(size(), min_buckets_wanted), size());
+    dense_hashtable tmp(std::move(*this), min_buckets_wanted);
+    swap(tmp);  // now we are tmp
+    settings.rehash_end(this, reason, old_buckets, bucket_count(), size(),
+                        start);
+  }
+
   // We require table be not-NULL and empty before calling this.
   void resize_table(size_type /*old_size*/, size_type new_size,
                     std::true_type) {
@@ -648,27 +873,130 @@ class dense_hashtable {
     // We use a normal iterator to get non-deleted bcks from ht
     // We could use insert() here, but since we know there are
     // no duplicates and no deleted items, we can be more efficient
-    assert((bucket_count() & (bucket_count() - 1)) == 0);  // a power of two
-    for (auto&& value : ht) {
-      size_type num_probes = 0;  // how many times we've probed
-      size_type bucknum;
-      const size_type bucket_count_minus_one = bucket_count() - 1;
-      for (bucknum = hash(get_key(value)) & bucket_count_minus_one;
-           !test_empty(bucknum);  // not empty
-           bucknum =
-               (bucknum + JUMP_(key, num_probes)) & bucket_count_minus_one) {
-        ++num_probes;
-        assert(num_probes < bucket_count() &&
-               "Hashtable is full: an error in key_equal<> or hash<>");
+    assert(settings.fine_grained_buckets() ||
+           (bucket_count() & (bucket_count() - 1)) == 0);  // a power of two
+    settings.count_rehash(ht.bucket_count(), bucket_count(),
+                          ht.size() * sizeof(value_type));
+    using will_move = std::is_rvalue_reference<Hashtable&&>;
+    using value_t = typename std::conditional<will_move::value, value_type&&, const_reference>::type;
+
+    const resize_policy::rehash_strategy_type strategy =
+        settings.policy().rehash_strategy;
+    if (strategy == resize_policy::REHASH_PREFETCH) {
+      // As in insert_batch(), but we keep pointers to the values of a
+      // block so we only walk the old buckets once.
+      size_type key_hashes[BATCH_SIZE];
+      decltype(&*ht.begin()) block[BATCH_SIZE];
+      for (auto it = ht.begin(); it != ht.end();) {
+        size_type n = 0;
+        for (; n < BATCH_SIZE && it != ht.end(); ++n, ++it) {
+          block[n] = &*it;
+          key_hashes[n] = hash(get_key(*it));
+          prefetch_bucket(first_bucket(key_hashes[n]));
+        }
+        for (size_type i = 0; i < n; ++i) {
+          fill_bucket(empty_bucket_for(key_hashes[i]),
+                      std::forward<value_t>(*block[i]));
+          num_elements++;
+        }
+      }
+    } else if (strategy != resize_policy::REHASH_PARTITIONED ||
+               !rehash_partitioned<value_t>(ht)) {
+      for (auto&& value : ht) {
+        fill_bucket(empty_bucket_for(hash(get_key(value))),
+                    std::forward<value_t>(value));
+        num_elements++;
       }
+    }
+    settings.inc_num_ht_copies();
+  }
 
-      using will_move = std::is_rvalue_reference<Hashtable&&>;
-      using value_t = typename std::conditional<will_move::value, value_type&&, const_reference>::type;
+  // The first empty bucket in the probe sequence for key_hash.  Used
+  // while rehashing, when there are no deleted buckets or duplicates.
+  size_type empty_bucket_for(size_type key_hash) const {
+    size_type num_probes = 0;  // how many times we've probed
+    size_type bucknum;
+    for (bucknum = first_bucket(key_hash); !test_empty(bucknum);
+         bucknum = next_bucket(bucknum, num_probes)) {
+      ++num_probes;
+      assert(num_probes < bucket_count() &&
+             "Hashtable is full: an error in key_equal<> or hash<>");
+    }
+    return bucknum;
+  }
+
+  // PARTITIONED REHASHING
+  // The new buckets are split into regions of about PARTITION_BYTES,
+  // which should fit in the L2 cache, and there are at most
+  // MAX_PARTITIONS of them, so that the write position of every
+  // partition stays in the L1 cache too.
+  static const size_t PARTITION_BYTES = 256 * 1024;
+  static const size_t MAX_PARTITIONS = 1024;
+
+  // Copies (or moves, if value_t is an rvalue reference) the values of
+  // ht into a scratch array, sorted by which region of the new buckets
+  // they hash to, and then moves them into the buckets one region at a
+  // time.  Both passes write to only a few places at once, so they miss
+  // the cache far less than placing each value as we come to it, once
+  // the new buckets don't fit in the cache.  This needs a value_type
+  // that moves without throwing.  Returns false, having done nothing,
+  // if it doesn't have one or the new buckets are small enough not to
+  // need this.
+  template <typename value_t, typename Hashtable>
+  bool rehash_partitioned(Hashtable& ht) {
+    if (!std::is_nothrow_move_constructible<value_type>::value) return false;
+    const size_t last_bucket = bucket_count() - 1;
+    size_t region_shift = 0;
+    while ((sizeof(value_type) << (region_shift + 1)) <= PARTITION_BYTES)
+      ++region_shift;
+    while ((last_bucket >> region_shift) >= MAX_PARTITIONS) ++region_shift;
+    const size_t num_partitions = (last_bucket >> region_shift) + 1;
+    if (num_partitions == 1 || ht.size() == 0) return false;
+
+    // First pass: hash everything, and count what goes in each region.
+    // Skipping the empty buckets is slow, so we do it only this once.
+    const size_type n = ht.size();
+    std::vector<size_type> key_hashes(n);
+    std::vector<decltype(&*ht.begin())> values(n);
+    std::vector<size_type> partition_next(num_partitions + 1, 0);
+    size_type i = 0;
+    for (auto it = ht.begin(); it != ht.end(); ++it, ++i) {
+      values[i] = &*it;
+      key_hashes[i] = hash(get_key(*it));
+      ++partition_next[(first_bucket(key_hashes[i]) >> region_shift) + 1];
+    }
+    for (size_t p = 0; p < num_partitions; ++p)
+      partition_next[p + 1] += partition_next[p];
+    std::vector<size_type> partition_start(partition_next);
+
+    // Second pass: move everything into its partition.  Partition p
+    // holds constructed values in [partition_start[p], partition_next[p]).
+    std::vector<size_type> sorted_hashes(n);
+    pointer buffer = val_info.allocate(n);
+    try {
+      for (i = 0; i < n; ++i) {
+        size_type& next =
+            partition_next[first_bucket(key_hashes[i]) >> region_shift];
+        new (&buffer[next]) value_type(std::forward<value_t>(*values[i]));
+        sorted_hashes[next++] = key_hashes[i];
+      }
+    } catch (...) {
+      for (size_t p = 0; p < num_partitions; ++p)
+        for (size_type j = partition_start[p]; j != partition_next[p]; ++j)
+          buffer[j].~value_type();
+      val_info.deallocate(buffer, n);
+      throw;
+    }
 
-      set_value(&table[bucknum], std::forward<value_t>(value));
+    // Last pass: fill in the buckets.  The values of a partition probe
+    // almost only inside its region, so its buckets stay in the cache.
+    for (i = 0; i < n; ++i) {
+      fill_bucket(empty_bucket_for(sorted_hashes[i]), std::move(buffer[i]));
+      buffer[i].~value_type();
       num_elements++;
     }
-    settings.inc_num_ht_copies();
+    val_info.deallocate(buffer, n);
+    return true;
   }
 
   // Required by the spec for hashed associative container
@@ -694,6 +1022,53 @@ class dense_hashtable {
     settings.reset_thresholds(bucket_count());
   }
 
+  // Tunes when we grow and shrink; see resize_policy in
+  // hashtable-common.h.  A byte budget counts what each bucket takes.
+  const resize_policy& get_resize_policy() const { return settings.policy(); }
+  void set_resize_policy(const resize_policy& policy) {
+    settings.set_policy(policy, sizeof(value_type) +
+                                    (split_keys ? sizeof(mutable_key_type) : 0));
+    settings.reset_thresholds(bucket_count());
+  }
+
+  // observer, if not NULL, is called with arg just before and just
+  // after every rehash; see resize_event in hashtable-common.h.
+  void set_resize_observer(resize_observer observer, void* arg = NULL) {
+    settings.set_resize_observer(observer, arg);
+  }
+
+  // By default bucket_count() is a power of two, so the table doubles
+  // when it grows.  With fine-grained buckets it grows by about a
+  // quarter instead, which keeps memory closer to what size() needs at
+  // the cost of some lookup speed.  Changing this rehashes the table.
+  bool fine_grained_buckets() const { return settings.fine_grained_buckets(); }
+  void set_fine_grained_buckets(bool fine) {
+    if (fine == settings.fine_grained_buckets()) return;
+    settings.set_fine_grained_buckets(fine);
+    rehash_to(bucket_count(), resize_event::REHASH);
+  }
+
+  // Seeded hashing mixes a random per-table seed into every hash, for
+  // tables whose keys come from clients who might pick keys that all
+  // land in the same buckets.  When an insert then probes more than
+  // reseed_probe_limit buckets, the next insert picks a new seed and
+  // rehashes, so such keys can't keep lookups slow.  Hash functions
+  // with a set_seed(uint64_t) method get the seed too, which also
+  // breaks up keys with identical hashes.  Changing this rehashes.
+  bool seeded_hashing() const { return settings.hash_seed() != 0; }
+  void set_seeded_hashing(bool seeded, size_type reseed_probe_limit = 64) {
+    settings.set_reseed_probe_limit(seeded ? reseed_probe_limit : 0);
+    set_hash_seed(seeded ? sparsehash_internal::random_hash_seed(this) : 0);
+  }
+  // The seed is part of the hash function, so to unserialize() a seeded
+  // table, first give the new table the old one's seed.  0 is unseeded.
+  uint64_t hash_seed() const { return settings.hash_seed(); }
+  void set_hash_seed(uint64_t seed) {
+    if (seed == settings.hash_seed()) return;
+    settings.set_hash_seed(seed);
+    rehash_to(bucket_count(), resize_event::REHASH);
+  }
+
   // CONSTRUCTORS -- as required by the specs, we take a size,
   // but also let you specify a hashfunction, key comparator,
   // and key extractor.  We also define a copy constructor and =.
@@ -712,9 +1087,12 @@ class dense_hashtable {
                         ? HT_DEFAULT_STARTING_BUCKETS
                         : settings.min_buckets(expected_max_items_in_table, 0)),
         val_info(alloc_impl<value_alloc_type>(alloc)),
-        table(NULL) {
-    // table is NULL until emptyval is set.  However, we set num_buckets
-    // here so we know how much space to allocate once emptyval is set
+        table(NULL),
+        states(NULL),
+        keys(NULL) {
+    // table is NULL until emptyval is set, or until the first insert if
+    // it never is.  However, we set num_buckets here so we know how much
+    // space to allocate then.
     settings.reset_thresholds(bucket_count());
   }
 
@@ -728,9 +1106,11 @@ class dense_hashtable {
         num_elements(0),
         num_buckets(0),
         val_info(ht.val_info),
-        table(NULL) {
-    if (!ht.settings.use_empty()) {
-      // If use_empty isn't set, copy_from will crash, so we do our own copying.
+        table(NULL),
+        states(NULL),
+        keys(NULL) {
+    if (!ht.table) {
+      // If ht has no table yet, there is nothing to copy but its size.
       assert(ht.empty());
       num_buckets = settings.min_buckets(ht.size(), min_buckets_wanted);
       settings.reset_thresholds(bucket_count());
@@ -753,9 +1133,11 @@ class dense_hashtable {
         num_elements(0),
         num_buckets(0),
         val_info(std::move(ht.val_info)),
-        table(NULL) {
-    if (!ht.settings.use_empty()) {
-      // If use_empty isn't set, copy_or_move_from will crash, so we do our own copying.
+        table(NULL),
+        states(NULL),
+        keys(NULL) {
+    if (!ht.table) {
+      // If ht has no table yet, there is nothing to move but its size.
       assert(ht.empty());
       num_buckets = settings.min_buckets(ht.size(), min_buckets_wanted);
       settings.reset_thresholds(bucket_count());
@@ -767,12 +1149,18 @@ class dense_hashtable {
 
   dense_hashtable& operator=(const dense_hashtable& ht) {
     if (&ht == this) return *this;  // don't copy onto ourselves
-    if (!ht.settings.use_empty()) {
+    if (!ht.table) {
       assert(ht.empty());
       dense_hashtable empty_table(ht);  // empty table with ht's thresholds
       this->swap(empty_table);
       return *this;
     }
+    if (settings.use_empty() != ht.settings.use_empty()) {
+      // Our buckets are laid out differently from ht's; start afresh.
+      dense_hashtable tmp(ht, HT_MIN_BUCKETS);
+      this->swap(tmp);
+      return *this;
+    }
     settings = ht.settings;
     key_info = ht.key_info;
     // copy_or_move_from() calls clear and sets num_deleted to 0 too
@@ -792,6 +1180,7 @@ class dense_hashtable {
       destroy_buckets(0, num_buckets);
       val_info.deallocate(table, num_buckets);
     }
+    deallocate_side_arrays(num_buckets);
   }
 
   // Many STL algorithms use swap instead of copy constructors
@@ -802,6 +1191,8 @@ class dense_hashtable {
     std::swap(num_elements, ht.num_elements);
     std::swap(num_buckets, ht.num_buckets);
     std::swap(table, ht.table);
+    std::swap(states, ht.states);
+    std::swap(keys, ht.keys);
     settings.reset_thresholds(bucket_count());  // also resets consider_shrink
     ht.settings.reset_thresholds(ht.bucket_count());
     // we purposefully don't swap the allocator, which may not be swap-able
@@ -811,6 +1202,7 @@ class dense_hashtable {
   void clear_to_size(size_type new_num_buckets) {
     if (!table) {
       table = val_info.allocate(new_num_buckets);
+      allocate_side_arrays(new_num_buckets);
     } else {
       destroy_buckets(0, num_buckets);
       if (new_num_buckets != num_buckets) {  // resize, if necessary
@@ -819,6 +1211,8 @@ class dense_hashtable {
                                libc_allocator_with_realloc<value_type>>::value>
             realloc_ok;
         resize_table(num_buckets, new_num_buckets, realloc_ok());
+        deallocate_side_arrays(num_buckets);
+        allocate_side_arrays(new_num_buckets);
       }
     }
     assert(table);
@@ -838,6 +1232,11 @@ class dense_hashtable {
     if (num_elements == 0 && new_num_buckets == num_buckets) {
       return;
     }
+    if (!table) {  // no need to allocate a table just to clear it
+      num_buckets = new_num_buckets;
+      settings.reset_thresholds(bucket_count());
+      return;
+    }
     clear_to_size(new_num_buckets);
   }
 
@@ -863,14 +1262,46 @@ class dense_hashtable {
   // if object is not found; 2nd is ILLEGAL_BUCKET if it is.
   // Note: because of deletions where-to-insert is not trivial: it's the
   // first deleted bucket we see, as long as we don't find the key later
+  // If probes is non-NULL, it is set to how many probes it took.
   template <typename K>
-  std::pair<size_type, size_type> find_position(const K& key) const {
+  std::pair<size_type, size_type> find_position(const K& key,
+                                                size_type* probes = NULL) const {
+    return find_position_with_hash(key, hash(key), probes);
+  }
+
+  // For parallel_insert(): like find_position_with_hash(), but only
+  // probes buckets in [first, last), and returns a pair of ILLEGAL_BUCKETs
+  // if the probe sequence leaves the range before it finds anything.
+  // There must be no deleted buckets.
+  template <typename K>
+  std::pair<size_type, size_type> find_position_in_range(
+      const K& key, size_type key_hash, size_type first,
+      size_type last) const {
+    assert(num_deleted == 0);
+    size_type num_probes = 0;
+    size_type bucknum = first_bucket(key_hash);
+    while (bucknum >= first && bucknum < last && num_probes < bucket_count()) {
+      if (test_empty(bucknum))
+        return std::pair<size_type, size_type>(ILLEGAL_BUCKET, bucknum);
+      if (bucket_key_equals(key, bucknum))
+        return std::pair<size_type, size_type>(bucknum, ILLEGAL_BUCKET);
+      ++num_probes;
+      bucknum = next_bucket(bucknum, num_probes);
+    }
+    return std::pair<size_type, size_type>(ILLEGAL_BUCKET, ILLEGAL_BUCKET);
+  }
+
+  // Same, but the caller already has hash(key), munged and seeded.
+  template <typename K>
+  std::pair<size_type, size_type> find_position_with_hash(
+      const K& key, size_type key_hash, size_type* probes = NULL) const {
     size_type num_probes = 0;  // how many times we've probed
-    const size_type bucket_count_minus_one = bucket_count() - 1;
-    size_type bucknum = hash(key) & bucket_count_minus_one;
+    size_type bucknum = first_bucket(key_hash);
     size_type insert_pos = ILLEGAL_BUCKET;  // where we would insert
     while (1) {                             // probe until something happens
       if (test_empty(bucknum)) {            // bucket is empty
+        if (probes) *probes = num_probes;
+        settings.count_lookup(num_probes);
         if (insert_pos == ILLEGAL_BUCKET)   // found no prior place to insert
           return std::pair<size_type, size_type>(ILLEGAL_BUCKET, bucknum);
         else
@@ -879,11 +1310,13 @@ class dense_hashtable {
       } else if (test_deleted(bucknum)) {  // keep searching, but mark to insert
         if (insert_pos == ILLEGAL_BUCKET) insert_pos = bucknum;
 
-      } else if (equals(key, get_key(table[bucknum]))) {
+      } else if (bucket_key_equals(key, bucknum)) {
+        if (probes) *probes = num_probes;
+        settings.count_lookup(num_probes);
         return std::pair<size_type, size_type>(bucknum, ILLEGAL_BUCKET);
       }
       ++num_probes;  // we're doing another probe
-      bucknum = (bucknum + JUMP_(key, num_probes)) & bucket_count_minus_one;
+      bucknum = next_bucket(bucknum, num_probes);
       assert(num_probes < bucket_count() &&
              "Hashtable is full: an error in key_equal<> or hash<>");
     }
@@ -897,7 +1330,7 @@ class dense_hashtable {
     if (pos.first == ILLEGAL_BUCKET)  // alas, not there
       return end();
     else
-      return iterator(this, table + pos.first, table + num_buckets, false);
+      return iterator(this, table + pos.first, table_end(), false);
   }
 
   template <typename K>
@@ -948,6 +1381,64 @@ class dense_hashtable {
     }
   }
 
+  // Lookups with a precomputed hash.  hash_function_value() is what the
+  // hasher returns for key, before we munge or seed it; compute it once
+  // and pass it to find(), count(), insert_with_hash() or erase() to
+  // avoid hashing the key again.  The value is only good for tables
+  // whose hasher is the same as this one's.
+  template <typename K>
+  size_t hash_function_value(const K& key) const {
+    return settings.raw_hash(key);
+  }
+
+  template <typename K>
+  iterator find(const K& key, size_t key_hash) {
+    assert(key_hash == hash_function_value(key) && "Wrong precomputed hash");
+    if (size() == 0) return end();
+    std::pair<size_type, size_type> pos =
+        find_position_with_hash(key, settings.munge_hash(key_hash));
+    if (pos.first == ILLEGAL_BUCKET)  // alas, not there
+      return end();
+    else
+      return iterator(this, table + pos.first, table_end(), false);
+  }
+
+  template <typename K>
+  const_iterator find(const K& key, size_t key_hash) const {
+    assert(key_hash == hash_function_value(key) && "Wrong precomputed hash");
+    if (size() == 0) return end();
+    std::pair<size_type, size_type> pos =
+        find_position_with_hash(key, settings.munge_hash(key_hash));
+    if (pos.first == ILLEGAL_BUCKET)  // alas, not there
+      return end();
+    else
+      return const_iterator(this, table + pos.first, table + num_buckets,
+                            false);
+  }
+
+  template <typename K>
+  size_type count(const K& key, size_t key_hash) const {
+    return find(key, key_hash) == end() ? 0 : 1;
+  }
+
+  // Starts loading the bucket a lookup of the key with this
+  // hash_function_value() would probe first, so that a caller holding
+  // several keys can overlap their cache misses.  Only a hint: it does
+  // nothing else, and nothing at all if no table is allocated yet.
+  void prefetch(size_t key_hash) const {
+    if (table) prefetch_bucket(first_bucket(settings.munge_hash(key_hash)));
+  }
+
+ private:
+  void prefetch_bucket(size_type bucknum) const {
+    sparsehash_internal::prefetch_for_write(table + bucknum);
+    if (split_keys)  // the probe compares these, not the buckets' keys
+      sparsehash_internal::prefetch_for_write(keys + bucknum);
+    if (use_state_bitmap())
+      sparsehash_internal::prefetch_for_write(states + bucknum / 32);
+  }
+
+ public:
   // INSERTION ROUTINES
  private:
   // Private method used by insert_noresize and find_or_insert.
@@ -965,24 +1456,38 @@ class dense_hashtable {
     } else {
       ++num_elements;  // replacing an empty bucket
     }
-    set_value(&table[pos], std::forward<Args>(args)...);
+    fill_bucket(pos, std::forward<Args>(args)...);
     return iterator(this, table + pos, table + num_buckets, false);
   }
 
   // If you know *this is big enough to hold obj, use this routine
   template <typename K, typename... Args>
   std::pair<iterator, bool> insert_noresize(K&& key, Args&&... args) {
+    const size_type key_hash = hash(key);
+    return insert_noresize_with_hash(key_hash, std::forward<K>(key),
+                                     std::forward<Args>(args)...);
+  }
+
+  // Same, but key_hash is hash(key), munged and seeded.
+  template <typename K, typename... Args>
+  std::pair<iterator, bool> insert_noresize_with_hash(size_type key_hash,
+                                                      K&& key,
+                                                      Args&&... args) {
     // First, double-check we're not inserting delkey or emptyval
-    assert(settings.use_empty() && "Inserting without empty key");
-    assert(!equals(std::forward<K>(key), key_info.empty_key) && "Inserting the empty key");
+    assert((!settings.use_empty() || !equals(key, key_info.empty_key)) &&
+           "Inserting the empty key");
     assert((!settings.use_deleted() || !equals(key, key_info.delkey)) && "Inserting the deleted key");
+    ensure_table();
 
-    const std::pair<size_type, size_type> pos = find_position(key);
+    size_type num_probes;
+    const std::pair<size_type, size_type> pos =
+        find_position_with_hash(key, key_hash, &num_probes);
     if (pos.first != ILLEGAL_BUCKET) {  // object was already there
       return std::pair<iterator, bool>(
           iterator(this, table + pos.first, table + num_buckets, false),
           false);  // false: we didn't insert
     } else {       // pos.second says where to put it
+      settings.note_insert_probes(num_probes, num_elements, bucket_count());
       return std::pair<iterator, bool>(insert_at(pos.second, std::forward<Args>(args)...), true);
     }
   }
@@ -1015,6 +1520,20 @@ class dense_hashtable {
     return insert_noresize(get_key(std::forward<Arg>(obj)), std::forward<Arg>(obj));
   }
 
+  // Insert with the precomputed hash_function_value() of obj's key.
+  template <typename Arg>
+  std::pair<iterator, bool> insert_with_hash(Arg&& obj, size_t key_hash) {
+    assert(key_hash == hash_function_value(get_key(obj)) &&
+           "Wrong precomputed hash");
+    const uint64_t seed = hash_seed();
+    resize_delta(1);  // adding an object, grow if need be
+    if (hash_seed() != seed)  // we reseeded, and the hasher may be seeded too
+      key_hash = hash_function_value(get_key(obj));
+    return insert_noresize_with_hash(settings.munge_hash(key_hash),
+                                     get_key(std::forward<Arg>(obj)),
+                                     std::forward<Arg>(obj));
+  }
+
   template <typename K, typename... Args>
   std::pair<iterator, bool> emplace(K&& key, Args&&... args) {
     resize_delta(1);
@@ -1069,6 +1588,155 @@ class dense_hashtable {
            typename std::iterator_traits<InputIterator>::iterator_category());
   }
 
+  // BATCHED INSERTION
+  // insert_batch(f, l, merge) inserts [f, l) like insert(f, l), but a
+  // block of BATCH_SIZE values at a time: it hashes the keys of a block
+  // and prefetches their home buckets before probing for any of them,
+  // so the cache misses overlap instead of coming one after another.
+  // For a value whose key is already there, in the table or earlier in
+  // the batch, it calls merge(existing, value) instead.  Returns how
+  // many values it inserted.
+  static const size_type BATCH_SIZE = 16;
+
+  template <class ForwardIterator, class Merge>
+  size_type insert_batch(ForwardIterator f, ForwardIterator l, Merge merge) {
+    static_assert(std::is_base_of<std::forward_iterator_tag,
+                      typename std::iterator_traits<ForwardIterator>::iterator_category>::value,
+                  "insert_batch() needs a forward iterator range");
+    size_t dist = std::distance(f, l);
+    if (dist >= (std::numeric_limits<size_type>::max)()) {
+      throw std::length_error("insert-range overflow");
+    }
+    resize_delta(static_cast<size_type>(dist));  // so nothing moves below
+    ensure_table();
+    size_type key_hashes[BATCH_SIZE];
+    size_type num_inserted = 0;
+    while (f != l) {
+      ForwardIterator block = f;
+      size_type n = 0;
+      for (; n < BATCH_SIZE && f != l; ++n, ++f) {
+        key_hashes[n] = hash(get_key(*f));
+        prefetch_bucket(first_bucket(key_hashes[n]));
+      }
+      for (size_type i = 0; i < n; ++i, ++block) {
+        std::pair<iterator, bool> res =
+            insert_noresize_with_hash(key_hashes[i], get_key(*block), *block);
+        if (res.second)
+          ++num_inserted;
+        else
+          merge(*res.first, *block);
+      }
+    }
+    return num_inserted;
+  }
+
+  template <class ForwardIterator>
+  size_type insert_batch(ForwardIterator f, ForwardIterator l) {
+    return insert_batch(f, l, keep_existing());
+  }
+
+  // PARALLEL CONSTRUCTION
+  // parallel_insert(f, l, merge, exec) does what insert_batch(f, l,
+  // merge) does, for a random-access range, on the threads of exec (as
+  // for the parallel sweeps below).  It grows the table once, hashes the
+  // values in parallel, and sorts them by home bucket into the ranges of
+  // PARALLEL_CHUNK buckets the sweeps use.  Then one thread per range
+  // inserts that range's values, probing only inside the range; a value
+  // whose probe sequence leaves the range first is set aside, and the
+  // values set aside are inserted one by one at the end.  Values are
+  // inserted and merged in the same order as by insert_batch(), so the
+  // result is the same.  It needs two size_types of scratch per value.
+  template <class RandomIterator, class Merge, class Executor>
+  size_type parallel_insert(RandomIterator f, RandomIterator l, Merge merge,
+                            Executor exec) {
+    static_assert(std::is_base_of<std::random_access_iterator_tag,
+                      typename std::iterator_traits<RandomIterator>::iterator_category>::value,
+                  "parallel_insert() needs a random-access range");
+    const size_t dist = l - f;
+    if (dist < PARALLEL_CHUNK)  // not worth the threads
+      return insert_batch(f, l, merge);
+    if (dist >= (std::numeric_limits<size_type>::max)()) {
+      throw std::length_error("insert-range overflow");
+    }
+    squash_deleted();  // so the probes below can ignore deleted buckets
+    resize_delta(static_cast<size_type>(dist));  // so nothing moves below
+    ensure_table();
+    auto&& run = sparsehash_internal::as_executor(exec);
+
+    const size_type num_ranges = (num_buckets + PARALLEL_CHUNK - 1) / PARALLEL_CHUNK;
+    std::vector<size_t> hashes, order, range_start;
+    sparsehash_internal::sort_by_range(
+        run, dist, num_ranges,
+        [&](size_t i) { return size_t(hash(get_key(f[i]))); },
+        [&](size_t h) { return first_bucket(h) / PARALLEL_CHUNK; },
+        &hashes, &order, &range_start);
+
+    std::vector<size_type> inserted(num_ranges, 0);
+    std::vector<std::vector<size_t>> set_aside(num_ranges);
+    try {
+      run(num_ranges, [&](size_t r) {
+        const size_type first = r * PARALLEL_CHUNK;
+        const size_type last = (std::min)(num_buckets, first + PARALLEL_CHUNK);
+        size_type n = 0;
+        try {
+          for (size_t k = range_start[r]; k < range_start[r + 1]; ++k) {
+            const size_t i = order[k];
+            const std::pair<size_type, size_type> pos =
+                find_position_in_range(get_key(f[i]), hashes[i], first, last);
+            if (pos.first != ILLEGAL_BUCKET) {
+              merge(table[pos.first], f[i]);
+            } else if (pos.second != ILLEGAL_BUCKET) {
+              fill_bucket(pos.second, f[i]);
+              ++n;
+            } else {
+              set_aside[r].push_back(i);
+            }
+          }
+        } catch (...) {
+          inserted[r] = n;
+          throw;
+        }
+        inserted[r] = n;
+      });
+    } catch (...) {
+      for (size_type r = 0; r < num_ranges; ++r) num_elements += inserted[r];
+      throw;
+    }
+    size_type num_inserted = 0;
+    for (size_type r = 0; r < num_ranges; ++r) num_inserted += inserted[r];
+    num_elements += num_inserted;
+
+    // The values set aside, in input order, so duplicates merge as above.
+    std::vector<size_t> rest;
+    for (size_type r = 0; r < num_ranges; ++r)
+      rest.insert(rest.end(), set_aside[r].begin(), set_aside[r].end());
+    std::sort(rest.begin(), rest.end());
+    for (size_t k = 0; k < rest.size(); ++k) {
+      const size_t i = rest[k];
+      std::pair<iterator, bool> res =
+          insert_noresize_with_hash(hashes[i], get_key(f[i]), f[i]);
+      if (res.second)
+        ++num_inserted;
+      else
+        merge(*res.first, f[i]);
+    }
+    return num_inserted;
+  }
+
+  template <class RandomIterator, class Executor>
+  size_type parallel_insert(RandomIterator f, RandomIterator l, Executor exec) {
+    return parallel_insert(f, l, keep_existing(), exec);
+  }
+
+ private:
+  // The merge for insert_batch(f, l): duplicates are dropped, as insert()
+  // drops them.
+  struct keep_existing {
+    template <class V>
+    void operator()(value_type&, const V&) const {}
+  };
+
+ public:
   // DefaultValue is a functor that takes a key and returns a value_type
   // representing the default value to be inserted if none is found.
   template <class T, class K>
@@ -1079,26 +1747,112 @@ class dense_hashtable {
         "Inserting the empty key");
     assert((!settings.use_deleted() || !equals(key, key_info.delkey)) &&
            "Inserting the deleted key");
-    const std::pair<size_type, size_type> pos = find_position(key);
+    ensure_table();
+    size_type num_probes;
+    const std::pair<size_type, size_type> pos = find_position(key, &num_probes);
     if (pos.first != ILLEGAL_BUCKET) {  // object was already there
       return table[pos.first];
     } else if (resize_delta(1)) {  // needed to rehash to make room
       // Since we resized, we can't use pos, so recalculate where to insert.
       return *insert_noresize(std::forward<K>(key), std::forward<K>(key), T()).first;
     } else {  // no need to rehash, insert right here
+      settings.note_insert_probes(num_probes, num_elements, bucket_count());
       return *insert_at(pos.second, std::forward<K>(key), T());
     }
   }
 
+  // LOOKUP HANDLES
+  // prepare(key) probes for key once and remembers where the probe
+  // ended: the bucket holding key, or the bucket an insert of key would
+  // use.  The caller can then read or assign the value, or emplace a
+  // new one, through the handle without probing again.  A handle points
+  // at key, and is good until the next change to the table.
+  template <typename K>
+  class lookup_handle {
+   public:
+    bool found() const { return found_ != ILLEGAL_BUCKET; }
+
+    // The element with key.  Only call this if found().
+    iterator position() const {
+      assert(found() && "Handle's key is not in the table");
+      return iterator(ht_, ht_->table + found_, ht_->table_end(), false);
+    }
+
+    // Inserts the value constructed from args, whose key must be the
+    // handle's key.  Only call this if !found(); afterwards found().
+    template <typename... Args>
+    iterator emplace(Args&&... args) {
+      return ht_->emplace_prepared(*this, std::forward<Args>(args)...);
+    }
+
+   private:
+    friend class dense_hashtable;
+    lookup_handle(dense_hashtable* ht, const K& key)
+        : ht_(ht), key_(&key), found_(ILLEGAL_BUCKET),
+          insert_pos_(ILLEGAL_BUCKET), num_probes_(0) {}
+
+    dense_hashtable* ht_;
+    const K* key_;
+    size_type found_;       // bucket holding key, or ILLEGAL_BUCKET
+    size_type insert_pos_;  // where key would go, or ILLEGAL_BUCKET
+    size_type num_probes_;
+  };
+
+  template <typename K>
+  lookup_handle<K> prepare(const K& key) {
+    // First, double-check we're not looking for emptykey or delkey
+    assert(
+        (!settings.use_empty() || !equals(key, key_info.empty_key)) &&
+        "Preparing the empty key");
+    assert((!settings.use_deleted() || !equals(key, key_info.delkey)) &&
+           "Preparing the deleted key");
+    ensure_table();
+    lookup_handle<K> handle(this, key);
+    const std::pair<size_type, size_type> pos =
+        find_position(key, &handle.num_probes_);
+    handle.found_ = pos.first;
+    handle.insert_pos_ = pos.second;
+    return handle;
+  }
+
+ private:
+  template <typename K, typename... Args>
+  iterator emplace_prepared(lookup_handle<K>& handle, Args&&... args) {
+    assert(!handle.found() && "Handle's key is already in the table");
+    if (resize_delta(1)) {  // needed to rehash to make room
+      // Since we resized, we can't use the handle's bucket, so look again.
+      handle.insert_pos_ =
+          find_position(*handle.key_, &handle.num_probes_).second;
+    }
+    settings.note_insert_probes(handle.num_probes_, num_elements,
+                                bucket_count());
+    iterator it = insert_at(handle.insert_pos_, std::forward<Args>(args)...);
+    handle.found_ = handle.insert_pos_;
+    handle.insert_pos_ = ILLEGAL_BUCKET;
+    return it;
+  }
+
+ public:
   // DELETION ROUTINES
-  size_type erase(const key_type& key) {
+  // K is key_type, or any type the key_equal can compare with it; the
+  // enable_if keeps erase(iterator) from picking this up.
+  template <typename K>
+  typename std::enable_if<!std::is_convertible<const K&, const_iterator>::value,
+                          size_type>::type
+  erase(const K& key) {
+    return erase(key, hash_function_value(key));
+  }
+
+  // key_hash is the precomputed hash_function_value(key).
+  template <typename K>
+  size_type erase(const K& key, size_t key_hash) {
     // First, double-check we're not trying to erase delkey or emptyval.
     assert(
         (!settings.use_empty() || !equals(key, key_info.empty_key)) &&
         "Erasing the empty key");
     assert((!settings.use_deleted() || !equals(key, key_info.delkey)) &&
            "Erasing the deleted key");
-    const_iterator pos = find(key);  // shrug: shouldn't need to be const
+    const_iterator pos = find(key, key_hash);  // shrug: shouldn't need to be const
     if (pos != end()) {
       assert(!test_deleted(pos));  // or find() shouldn't have returned it
       set_deleted(pos);
@@ -1132,6 +1886,112 @@ class dense_hashtable {
     return iterator(this, const_cast<pointer>(f.pos), const_cast<pointer>(f.end), false);
   }
 
+  // PARALLEL SWEEPS
+  // These split the buckets into ranges of PARALLEL_CHUNK buckets and
+  // run them on exec, which is an executor (see thread_executor.h) or
+  // the number of threads for a thread_executor, 0 meaning one per
+  // hardware thread.  A range is a whole number of state bitmap words,
+  // so no two ranges share a word.  Nothing else may use the table
+  // while a sweep runs.
+  static const size_type PARALLEL_CHUNK = 32 * 1024;
+
+  // Calls f(value) for every element.
+  template <class F, class Executor>
+  void parallel_for_each(F f, Executor exec) {
+    for_each_range(exec, [&](size_type, size_type first, size_type last) {
+      const iterator range_end(this, table + last, table + last, false);
+      for (iterator it(this, table + first, table + last, true);
+           it != range_end; ++it)
+        f(*it);
+    });
+  }
+  template <class F, class Executor>
+  void parallel_for_each(F f, Executor exec) const {
+    for_each_range(exec, [&](size_type, size_type first, size_type last) {
+      const const_iterator range_end(this, table + last, table + last, false);
+      for (const_iterator it(this, table + first, table + last, true);
+           it != range_end; ++it)
+        f(*it);
+    });
+  }
+
+  // Erases every element for which pred(value) is true, and returns how
+  // many that was.  Each range counts its own erasures; they are added
+  // to num_deleted once all ranges are done, even if pred throws.
+  template <class Pred, class Executor>
+  size_type parallel_erase_if(Pred pred, Executor exec) {
+    check_use_deleted("parallel_erase_if()");
+    std::vector<size_type> erased(num_parallel_ranges(), 0);
+    try {
+      for_each_range(exec, [&](size_type r, size_type first, size_type last) {
+        const const_iterator range_end(this, table + last, table + last, false);
+        size_type n = 0;
+        try {
+          for (const_iterator it(this, table + first, table + last, true);
+               it != range_end; ++it) {
+            if (pred(*it) && set_deleted(it)) ++n;
+          }
+        } catch (...) {
+          erased[r] = n;
+          throw;
+        }
+        erased[r] = n;
+      });
+    } catch (...) {
+      note_parallel_erased(erased);
+      throw;
+    }
+    return note_parallel_erased(erased);
+  }
+
+  // Folds the elements of each range into a copy of identity with
+  // accumulate(partial, value), then folds the partial results together,
+  // in range order, with combine(result, partial).
+  template <class Result, class Accumulate, class Combine, class Executor>
+  Result parallel_reduce(Result identity, Accumulate accumulate,
+                         Combine combine, Executor exec) const {
+    std::vector<Result> partials(num_parallel_ranges(), identity);
+    for_each_range(exec, [&](size_type r, size_type first, size_type last) {
+      const const_iterator range_end(this, table + last, table + last, false);
+      for (const_iterator it(this, table + first, table + last, true);
+           it != range_end; ++it)
+        accumulate(partials[r], *it);
+    });
+    Result result = identity;
+    for (size_type r = 0; r < partials.size(); ++r) combine(result, partials[r]);
+    return result;
+  }
+
+ private:
+  size_type num_parallel_ranges() const {
+    if (size() == 0) return 0;  // includes the case of no table yet
+    return (num_buckets + PARALLEL_CHUNK - 1) / PARALLEL_CHUNK;
+  }
+
+  // Calls fn(range, first_bucket, last_bucket) for every range, on exec.
+  template <class Executor, class RangeFn>
+  void for_each_range(Executor& exec, RangeFn fn) const {
+    const size_type num_ranges = num_parallel_ranges();
+    if (num_ranges == 0) return;
+    auto&& run = sparsehash_internal::as_executor(exec);
+    run(num_ranges, [&](size_t r) {
+      const size_type first = r * PARALLEL_CHUNK;
+      fn(r, first, (std::min)(num_buckets, first + PARALLEL_CHUNK));
+    });
+  }
+
+  size_type note_parallel_erased(const std::vector<size_type>& erased) {
+    size_type total = 0;
+    for (size_type r = 0; r < erased.size(); ++r) total += erased[r];
+    if (total > 0) {
+      num_deleted += total;
+      settings.set_consider_shrink(
+          true);  // will think about shrink after next insert
+    }
+    return total;
+  }
+
+ public:
   // COMPARISON
   bool operator==(const dense_hashtable& ht) const {
     if (size() != ht.size()) {
@@ -1159,7 +2019,15 @@ class dense_hashtable {
  private:
   // Every time the disk format changes, this should probably change too
   typedef unsigned long MagicNumberType;
-  static const MagicNumberType MAGIC_NUMBER = 0x13578642;
+  static const MagicNumberType MAGIC_NUMBER = 0x13578644;
+  static const MagicNumberType CHUNKED_MAGIC_NUMBER = 0x13578643;
+  // Files from before integer and pointer hashes were finalized (see
+  // sh_hashtable_settings) have the buckets in the old hash order.  We
+  // still read them, and rehash.
+  static const MagicNumberType OLD_HASH_MAGIC_NUMBER = 0x13578642;
+  // The header of the chunked format: magic number, bucket count,
+  // element count and buckets per chunk.
+  static const size_t CHUNKED_HEADER_SIZE = 4 + 3 * 8;
 
  public:
   // I/O -- this is an add-on for writing hash table to disk
@@ -1176,58 +2044,242 @@ class dense_hashtable {
   template <typename ValueSerializer, typename OUTPUT>
   bool serialize(ValueSerializer serializer, OUTPUT* fp) {
     squash_deleted();  // so we don't have to worry about delkey
-    if (!sparsehash_internal::write_bigendian_number(fp, MAGIC_NUMBER, 4))
+    sparsehash_internal::buffered_writer<OUTPUT> out(fp);
+    if (!sparsehash_internal::write_bigendian_number(&out, MAGIC_NUMBER, 4))
       return false;
-    if (!sparsehash_internal::write_bigendian_number(fp, num_buckets, 8))
+    if (!sparsehash_internal::write_bigendian_number(&out, num_buckets, 8))
       return false;
-    if (!sparsehash_internal::write_bigendian_number(fp, num_elements, 8))
+    if (!sparsehash_internal::write_bigendian_number(&out, num_elements, 8))
       return false;
-    // Now write a bitmap of non-empty buckets.
-    for (size_type i = 0; i < num_buckets; i += 8) {
-      unsigned char bits = 0;
-      for (int bit = 0; bit < 8; ++bit) {
-        if (i + bit < num_buckets && !test_empty(i + bit)) bits |= (1 << bit);
-      }
-      if (!sparsehash_internal::write_data(fp, &bits, sizeof(bits)))
-        return false;
-      for (int bit = 0; bit < 8; ++bit) {
-        if (bits & (1 << bit)) {
-          if (!serializer(fp, table[i + bit])) return false;
-        }
+    // Now write a bitmap of non-empty buckets, a byte for every 8, each
+    // followed by the values of the buckets it marks.
+    for (size_type i = 0; i < num_buckets; i += 64) {
+      const uint64_t word = nonempty_bits(i);
+      for (size_type b = 0; b < 64 && i + b < num_buckets; b += 8) {
+        const unsigned char bits = static_cast<unsigned char>(word >> b);
+        if (!sparsehash_internal::write_data(&out, &bits, sizeof(bits)))
+          return false;
+        if (!write_marked_values(serializer, &out, i + b, bits)) return false;
       }
     }
-    return true;
+    return out.flush();
   }
 
   // INPUT: anything we've written an overload of read_data() for.
   // ValueSerializer: a functor.  operator()(INPUT*, value_type*)
   template <typename ValueSerializer, typename INPUT>
   bool unserialize(ValueSerializer serializer, INPUT* fp) {
-    assert(settings.use_empty() && "empty_key not set for read");
-
     clear();  // just to be consistent
+    sparsehash_internal::buffered_reader<INPUT> in(fp);
     MagicNumberType magic_read;
-    if (!sparsehash_internal::read_bigendian_number(fp, &magic_read, 4))
+    in.expect(4);
+    if (!sparsehash_internal::read_bigendian_number(&in, &magic_read, 4))
       return false;
-    if (magic_read != MAGIC_NUMBER) {
+    if (magic_read != MAGIC_NUMBER && magic_read != OLD_HASH_MAGIC_NUMBER) {
       return false;
     }
+    in.expect(16);
     size_type new_num_buckets;
-    if (!sparsehash_internal::read_bigendian_number(fp, &new_num_buckets, 8))
+    if (!sparsehash_internal::read_bigendian_number(&in, &new_num_buckets, 8))
       return false;
     clear_to_size(new_num_buckets);
-    if (!sparsehash_internal::read_bigendian_number(fp, &num_elements, 8))
+    if (!sparsehash_internal::read_bigendian_number(&in, &num_elements, 8))
       return false;
+    // With pod_serializer we know how long the rest is, so we can read
+    // it in big blocks.
+    if (sparsehash_internal::is_pod_serializer<ValueSerializer,
+                                               value_type>::value &&
+        num_elements <= num_buckets)
+      in.expect((num_buckets + 7) / 8 + num_elements * sizeof(value_type));
 
     // Read the bitmap of non-empty buckets.
     for (size_type i = 0; i < num_buckets; i += 8) {
       unsigned char bits;
-      if (!sparsehash_internal::read_data(fp, &bits, sizeof(bits)))
+      if (!sparsehash_internal::read_data(&in, &bits, sizeof(bits)))
         return false;
-      for (int bit = 0; bit < 8; ++bit) {
-        if (i + bit < num_buckets && (bits & (1 << bit))) {  // not empty
-          if (!serializer(fp, &table[i + bit])) return false;
-        }
+      if (num_buckets - i < 8) bits &= (1 << (num_buckets - i)) - 1;
+      if (!read_marked_values(serializer, &in, i, bits)) return false;
+    }
+    if (magic_read == OLD_HASH_MAGIC_NUMBER)
+      rehash_to(bucket_count(), resize_event::REHASH);
+    return true;
+  }
+
+  // PARALLEL SERIALIZATION
+  // parallel_serialize(serializer, fd, exec) writes the table to the
+  // file fd, from its start, in the chunked format described in
+  // chunked_io.h.  Each chunk covers PARALLEL_CHUNK buckets and holds
+  // what serialize() would write for them.  The chunks are serialized
+  // on the threads of exec (as for the parallel sweeps) and written
+  // with pwrite().  parallel_unserialize() reads such a file back with
+  // pread(), a chunk per task, straight into the buckets.  Each task
+  // has its own copy of serializer, and calls it with an in-memory
+  // stream, so it must take any INPUT or OUTPUT, as pod_serializer does.
+  template <typename ValueSerializer, typename Executor>
+  bool parallel_serialize(ValueSerializer serializer, int fd, Executor exec) {
+    squash_deleted();  // so we don't have to worry about delkey
+    sparsehash_internal::memory_output header;
+    sparsehash_internal::write_bigendian_number(&header, CHUNKED_MAGIC_NUMBER,
+                                                4);
+    sparsehash_internal::write_bigendian_number(&header, num_buckets, 8);
+    sparsehash_internal::write_bigendian_number(&header, num_elements, 8);
+    sparsehash_internal::write_bigendian_number(&header, PARALLEL_CHUNK, 8);
+    auto&& run = sparsehash_internal::as_executor(exec);
+    return sparsehash_internal::write_chunked(
+        run, fd, header, (num_buckets + PARALLEL_CHUNK - 1) / PARALLEL_CHUNK,
+        [&](size_t c, sparsehash_internal::memory_output* out) {
+          ValueSerializer chunk_serializer(serializer);
+          const size_type first = c * PARALLEL_CHUNK;
+          const size_type last = (std::min)(first + PARALLEL_CHUNK,
+                                            num_buckets);
+          for (size_type i = first; i < last; i += 64) {
+            const uint64_t word = nonempty_bits(i);
+            for (size_type b = 0; b < 64 && i + b < last; b += 8) {
+              const unsigned char bits = static_cast<unsigned char>(word >> b);
+              if (!sparsehash_internal::write_data(out, &bits, sizeof(bits)) ||
+                  !write_marked_values(chunk_serializer, out, i + b, bits))
+                return false;
+            }
+          }
+          return true;
+        });
+  }
+
+  template <typename ValueSerializer, typename Executor>
+  bool parallel_unserialize(ValueSerializer serializer, int fd,
+                            Executor exec) {
+    clear();  // just to be consistent
+    std::vector<char> raw;
+    if (!sparsehash_internal::read_chunked_header(fd, CHUNKED_HEADER_SIZE,
+                                                  &raw))
+      return false;
+    sparsehash_internal::memory_input header(&raw[0], raw.size());
+    MagicNumberType magic_read;
+    size_type new_num_buckets, elements_expected, chunk_buckets;
+    if (!sparsehash_internal::read_bigendian_number(&header, &magic_read, 4) ||
+        magic_read != CHUNKED_MAGIC_NUMBER)
+      return false;
+    if (!sparsehash_internal::read_bigendian_number(&header, &new_num_buckets,
+                                                    8) ||
+        !sparsehash_internal::read_bigendian_number(&header,
+                                                    &elements_expected, 8) ||
+        !sparsehash_internal::read_bigendian_number(&header, &chunk_buckets,
+                                                    8))
+      return false;
+    // Chunks share no words of the state bitmap, so tasks can't race.
+    if (chunk_buckets == 0 || chunk_buckets % 64 != 0) return false;
+    clear_to_size(new_num_buckets);
+
+    const size_type num_chunks =
+        num_buckets / chunk_buckets + (num_buckets % chunk_buckets != 0);
+    std::vector<size_type> chunk_elements(num_chunks, 0);
+    auto&& run = sparsehash_internal::as_executor(exec);
+    const bool ok = sparsehash_internal::read_chunked(
+        run, fd, CHUNKED_HEADER_SIZE, num_chunks,
+        [&](size_t c, sparsehash_internal::memory_input* in) {
+          ValueSerializer chunk_serializer(serializer);
+          const size_type first = c * chunk_buckets;
+          const size_type last = (std::min)(first + chunk_buckets,
+                                            num_buckets);
+          for (size_type i = first; i < last; i += 8) {
+            unsigned char bits;
+            if (!sparsehash_internal::read_data(in, &bits, sizeof(bits)))
+              return false;
+            if (last - i < 8) bits &= (1 << (last - i)) - 1;
+            if (!read_marked_values(chunk_serializer, in, i, bits))
+              return false;
+            for (unsigned rest = bits; rest; rest &= rest - 1)
+              ++chunk_elements[c];
+          }
+          return true;
+        });
+    for (size_type c = 0; c < num_chunks; ++c) num_elements += chunk_elements[c];
+    return ok && num_elements == elements_expected;
+  }
+
+ private:
+  // One bit for each of the 64 buckets from first on (fewer at the
+  // end), set if the bucket isn't empty.  Without an empty key we just
+  // pack the state bitmap; with one, the loop has no branches, so the
+  // compiler can vectorize the key comparisons for simple keys.
+  uint64_t nonempty_bits(size_type first) const {
+    if (!table) return 0;  // not allocated yet, so all empty
+    const size_type n = (std::min)(size_type(64), num_buckets - first);
+    uint64_t bits = 0;
+    if (use_state_bitmap()) {
+      if (!states) return 0;
+      bits = sparsehash_internal::pack_state_word(states[first / 32]);
+      if (n > 32)
+        bits |= uint64_t(sparsehash_internal::pack_state_word(
+                    states[first / 32 + 1])) << 32;
+    } else {
+      for (size_type b = 0; b < n; ++b)
+        bits |= uint64_t(!bucket_key_equals(key_info.empty_key, first + b))
+                << b;
+    }
+    return n < 64 ? bits & ((uint64_t(1) << n) - 1) : bits;
+  }
+
+  // Writes the values of the buckets from first on that bits marks.
+  // pod_serializer's go straight into the buffer, a run of adjacent
+  // buckets at a time; other serializers get out->stream(), which for
+  // a buffered_writer is the caller's stream.
+  template <typename ValueSerializer, typename Writer>
+  bool write_marked_values(ValueSerializer& serializer, Writer* out,
+                           size_type first, unsigned bits) const {
+    if (sparsehash_internal::is_pod_serializer<ValueSerializer,
+                                               value_type>::value) {
+      while (bits) {
+        const int start = sparsehash_internal::count_trailing_zeros64(bits);
+        int end = start + 1;
+        while (bits & (1u << end)) ++end;
+        if (!sparsehash_internal::write_data(
+                out, &table[first + start],
+                (end - start) * sizeof(value_type)))
+          return false;
+        bits &= ~((1u << end) - 1);
+      }
+      return true;
+    }
+    for (int bit = 0; bit < 8; ++bit) {
+      if (bits & (1 << bit)) {
+        if (!out->flush() || !serializer(out->stream(), table[first + bit]))
+          return false;
+      }
+    }
+    return true;
+  }
+
+  // The other way round: reads the values of the buckets marked, and
+  // marks them occupied.
+  template <typename ValueSerializer, typename Reader>
+  bool read_marked_values(ValueSerializer& serializer, Reader* in,
+                          size_type first, unsigned bits) {
+    if (sparsehash_internal::is_pod_serializer<ValueSerializer,
+                                               value_type>::value) {
+      for (unsigned rest = bits; rest;) {
+        const int start = sparsehash_internal::count_trailing_zeros64(rest);
+        int end = start + 1;
+        while (rest & (1u << end)) ++end;
+        if (!sparsehash_internal::read_data(
+                in, &table[first + start], (end - start) * sizeof(value_type)))
+          return false;
+        rest &= ~((1u << end) - 1);
+      }
+      if (use_state_bitmap())  // first is a multiple of 8
+        states[first / 32] |= sparsehash_internal::unpack_state_word(bits)
+                              << (2 * (first % 32));
+      if (split_keys) {
+        for (int bit = 0; bit < 8; ++bit)
+          if (bits & (1 << bit)) keys[first + bit] = get_key(table[first + bit]);
+      }
+      return true;
+    }
+    for (int bit = 0; bit < 8; ++bit) {
+      if (bits & (1 << bit)) {  // not empty
+        if (!serializer(in->stream(), &table[first + bit])) return false;
+        if (use_state_bitmap()) set_state(first + bit, BUCKET_OCCUPIED);
+        if (split_keys) keys[first + bit] = get_key(table[first + bit]);
       }
     }
     return true;
@@ -1335,6 +2387,17 @@ class dense_hashtable {
   // Utility functions to access the templated operators
   template <typename K>
   size_type hash(const K& v) const { return settings.hash(v); }
+
+  // Where the probe sequence for a hash value starts, and where it goes
+  // after num_probes probes.
+  size_type first_bucket(size_type h) const {
+    return settings.bucket_for_hash(h, bucket_count());
+  }
+  size_type next_bucket(size_type bucknum, size_type num_probes) const {
+    if (settings.fine_grained_buckets())  // see the top of this file
+      return bucknum + 1 == bucket_count() ? 0 : bucknum + 1;
+    return (bucknum + JUMP_(key, num_probes)) & (bucket_count() - 1);
+  }
   template <typename K1, typename K2>
   bool equals(const K1& a, const K2& b) const {
     return key_info.equals(a, b);
@@ -1356,6 +2419,8 @@ class dense_hashtable {
   size_type num_buckets;
   ValInfo val_info;  // holds emptyval, and also the allocator
   pointer table;
+  uint64_t* states;  // 2 bits per bucket, only used without an empty key
+  mutable_key_type* keys;  // copy of each bucket's key, only if split_keys
 };
 
 // We need a global swap as well
@@ -39,15 +39,278 @@
 
 #pragma once
 
+#include <atomic>
 #include <cassert>
+#include <chrono>
 #include <cstdio>
 #include <cstddef>  // for size_t
+#include <cstdint>  // for uint64_t
+#include <cstring>  // for memcpy
 #include <iosfwd>
+#include <limits>     // for numeric_limits
 #include <stdexcept>  // For length_error
+#include <type_traits>
+#include <vector>     // for the serialize buffers
+#include <sparsehash/traits>
+
+// Static tracepoints.  Every rehash -- growing, shrinking, or just
+// dropping deleted entries -- calls sparsehash_rehash_begin() before
+// and sparsehash_rehash_end() after.  They do nothing, but they are
+// never inlined, so perf and bpftrace can attach uprobes to them by
+// name and time the rehash themselves, for instance
+//   bpftrace -e 'uprobe:./server:sparsehash_rehash_begin { @t[tid] = nsecs; }
+//                uretprobe:./server:sparsehash_rehash_end /@t[tid]/ {
+//                  @us = hist((nsecs - @t[tid]) / 1000); delete(@t[tid]); }'
+// The arguments are the table's address, the resize_event::reason_type,
+// the bucket counts before and after, and the number of elements.
+// Define SPARSEHASH_USE_SYS_SDT to make them USDT probes as well
+// (provider "sparsehash"), if you have <sys/sdt.h>, or
+// SPARSEHASH_NO_TRACEPOINTS to leave them out.
+#if defined(__GNUC__) && !defined(SPARSEHASH_NO_TRACEPOINTS)
+#ifdef SPARSEHASH_USE_SYS_SDT
+#include <sys/sdt.h>
+#endif
+extern "C" {
+__attribute__((noinline)) inline void sparsehash_rehash_begin(
+    const void* table, int reason, size_t old_buckets, size_t new_buckets,
+    size_t num_elements) {
+#ifdef SPARSEHASH_USE_SYS_SDT
+  DTRACE_PROBE5(sparsehash, rehash_begin, table, reason, old_buckets,
+                new_buckets, num_elements);
+#endif
+  // Keeps the compiler from dropping the call as having no effect.
+  __asm__ __volatile__(""
+                       :
+                       : "g"(table), "g"(reason), "g"(old_buckets),
+                         "g"(new_buckets), "g"(num_elements)
+                       : "memory");
+}
+__attribute__((noinline)) inline void sparsehash_rehash_end(
+    const void* table, int reason, size_t old_buckets, size_t new_buckets,
+    size_t num_elements) {
+#ifdef SPARSEHASH_USE_SYS_SDT
+  DTRACE_PROBE5(sparsehash, rehash_end, table, reason, old_buckets,
+                new_buckets, num_elements);
+#endif
+  __asm__ __volatile__(""
+                       :
+                       : "g"(table), "g"(reason), "g"(old_buckets),
+                         "g"(new_buckets), "g"(num_elements)
+                       : "memory");
+}
+}
+#define SPARSEHASH_TRACE_REHASH(point, table, reason, old_buckets, \
+                                new_buckets, num_elements)          \
+  sparsehash_rehash_##point(table, reason, old_buckets, new_buckets, \
+                            num_elements)
+#else
+#define SPARSEHASH_TRACE_REHASH(point, table, reason, old_buckets, \
+                                new_buckets, num_elements)          \
+  ((void)0)
+#endif
 
 namespace google {
+
+// What a resize observer hears about a rehash; see set_resize_observer().
+struct resize_event {
+  enum reason_type {
+    RESIZE,          // an insert or resize() needed more room
+    SHRINK,          // erases left the table too empty
+    SQUASH_DELETED,  // serialize() dropping deleted entries first
+    REHASH           // the hash function or bucket layout changed
+  };
+  reason_type reason;
+  bool done;                // false just before the rehash, true just after
+  const void* table;        // which hashtable
+  size_t old_bucket_count;
+  size_t new_bucket_count;  // before the rehash, what it's expected to be
+  size_t num_elements;
+  uint64_t elapsed_ns;      // how long the rehash took; 0 before it
+};
+
+// Called before and after each rehash with arg as given to
+// set_resize_observer().  It mustn't touch the hashtable.
+typedef void (*resize_observer)(const resize_event& event, void* arg);
+
+// A resize_policy tunes when a hashtable grows and shrinks, on top of
+// the load factors set with max_load_factor() and min_load_factor().
+// Hand one to set_resize_policy().  The defaults keep the usual
+// behavior: double when too full, shrink on the first insert after
+// enough erases, no limit on size.
+struct resize_policy {
+  // How much bucket_count() grows at each step.  0 picks the table's
+  // default: 2, or 1.25 with fine-grained buckets.  Tables whose bucket
+  // counts are powers of two round each step up to a power of two.
+  float growth_factor = 0;
+
+  // Once erases have left the table too empty, wait for this many
+  // inserts in a row, with no erase in between, before shrinking.  This
+  // keeps a table whose size oscillates from shrinking and regrowing.
+  size_t shrink_delay = 0;
+
+  // If non-zero, the buckets never grow past this many bytes.  A table
+  // at its budget lets its load factor rise instead of growing, and
+  // insert() throws length_error once no empty bucket would be left.
+  size_t max_bytes = 0;
+
+  // If non-zero, an insert that probes more than this many buckets makes
+  // the next insert grow the table, even below max_load_factor().  Only
+  // tables at least half way to their grow threshold do this, so a bad
+  // hash function can't make the table grow without bound.
+  size_t max_probe_length = 0;
+
+  // How dense_hash_map and dense_hash_set move their elements into the
+  // new buckets when they rehash; sparse tables ignore this.  Once the
+  // new buckets are bigger than the cache, placing the elements in
+  // iteration order misses the cache on nearly every one of them.
+  enum rehash_strategy_type {
+    REHASH_DIRECT,       // place each element as we come to it
+    REHASH_PREFETCH,     // hash a block of elements and prefetch their
+                         // buckets before placing any of them
+    REHASH_PARTITIONED   // first move the elements into partitions by
+                         // the high bits of their bucket, then fill in
+                         // the new buckets one cache-sized region at a
+                         // time; needs room for a copy of the elements
+  };
+  rehash_strategy_type rehash_strategy = REHASH_DIRECT;
+};
+
+// Probe counts go in histograms with one slot per power of two: slot
+// 0 counts 0 probes, slot 1 counts 1, slot 2 counts 2-3, slot 3 counts
+// 4-7, and so on; the last slot counts everything past that.
+static const int kProbeHistogramSize = 16;
+
+// What compute_stats() finds by scanning a hashtable.  It takes time
+// proportional to bucket_count(), and costs nothing until called.
+struct hashtable_stats {
+  size_t size = 0;
+  size_t bucket_count = 0;
+  size_t num_deleted = 0;      // tombstones: buckets erased since a rehash
+  double load_factor = 0;      // size / bucket_count
+  double tombstone_ratio = 0;  // num_deleted / bucket_count
+
+  // A cluster is a run of adjacent non-empty (live or deleted) buckets.
+  size_t num_clusters = 0;
+  size_t max_cluster_length = 0;
+  double mean_cluster_length = 0;
+
+  // An element's displacement is how many probes find() takes to get
+  // to it from the bucket its hash points at.
+  size_t max_displacement = 0;
+  double mean_displacement = 0;
+  size_t displacement_histogram[kProbeHistogramSize] = {};
+};
+
+// What a hashtable counts as it runs, if you compile with
+// SPARSEHASH_COLLECT_STATS defined; see counters().  Without it, nothing
+// is counted and the tables don't even have room for the counts.
+// Define it the same way in every file that includes these headers.
+// Const lookups may run on several threads at once, so they count
+// with relaxed atomic adds; counters() is a copy of the counts.
+struct hashtable_counters {
+  uint64_t lookups = 0;        // every probe sequence, for find or insert
+  uint64_t lookup_probes = 0;  // total probes past the first bucket
+  uint64_t probe_histogram[kProbeHistogramSize] = {};
+  uint64_t inserts = 0;        // lookups that went on to add an element
+  uint64_t insert_probes = 0;
+  uint64_t grows = 0;          // rehashes into more buckets...
+  uint64_t shrinks = 0;        // ...fewer buckets...
+  uint64_t rehashes = 0;       // ...or as many (to drop tombstones, say)
+  uint64_t bytes_moved = 0;    // by all of those, counting values only
+};
+
+template <class T>
+class packed;  // in <sparsehash/packed>
+
 namespace sparsehash_internal {
 
+// The type a key is hashed as, for deciding whether to munge its hash.
+// A packed<T> hashes just like the T it holds.
+template <class Key>
+struct hashed_key_type {
+  typedef Key type;
+};
+template <class T>
+struct hashed_key_type<packed<T>> {
+  typedef T type;
+};
+
+// A count that const lookups on several threads can add to at once.
+// Copying it copies the count, so tables holding one stay copyable.
+class relaxed_counter {
+ public:
+  relaxed_counter() : n_(0) {}
+  relaxed_counter(const relaxed_counter& other) : n_(other.get()) {}
+  relaxed_counter& operator=(const relaxed_counter& other) {
+    n_.store(other.get(), std::memory_order_relaxed);
+    return *this;
+  }
+
+  void add(uint64_t n) const { n_.fetch_add(n, std::memory_order_relaxed); }
+  uint64_t get() const { return n_.load(std::memory_order_relaxed); }
+
+ private:
+  mutable std::atomic<uint64_t> n_;
+};
+
+// The slot of a kProbeHistogramSize histogram that counts n.
+inline int probe_histogram_slot(uint64_t n) {
+  int slot = 0;
+  while (n != 0 && slot < kProbeHistogramSize - 1) {
+    n >>= 1;
+    ++slot;
+  }
+  return slot;
+}
+
+// Builds a hashtable_stats as a table walks its buckets in order,
+// calling one of these for each.
+class stats_scanner {
+ public:
+  stats_scanner() : cluster_(0), total_cluster_(0), total_displacement_(0) {}
+
+  void empty_bucket() {
+    if (cluster_ == 0) return;
+    ++stats_.num_clusters;
+    total_cluster_ += cluster_;
+    if (cluster_ > stats_.max_cluster_length)
+      stats_.max_cluster_length = cluster_;
+    cluster_ = 0;
+  }
+  void deleted_bucket() { ++cluster_; }
+  void element(size_t displacement) {
+    ++cluster_;
+    total_displacement_ += displacement;
+    if (displacement > stats_.max_displacement)
+      stats_.max_displacement = displacement;
+    ++stats_.displacement_histogram[probe_histogram_slot(displacement)];
+  }
+
+  hashtable_stats finish(size_t size, size_t bucket_count,
+                         size_t num_deleted) {
+    empty_bucket();  // a cluster may run up to the last bucket
+    stats_.size = size;
+    stats_.bucket_count = bucket_count;
+    stats_.num_deleted = num_deleted;
+    if (bucket_count > 0) {
+      stats_.load_factor = static_cast<double>(size) / bucket_count;
+      stats_.tombstone_ratio = static_cast<double>(num_deleted) / bucket_count;
+    }
+    if (stats_.num_clusters > 0)
+      stats_.mean_cluster_length =
+          static_cast<double>(total_cluster_) / stats_.num_clusters;
+    if (size > 0)
+      stats_.mean_displacement = static_cast<double>(total_displacement_) / size;
+    return stats_;
+  }
+
+ private:
+  hashtable_stats stats_;
+  size_t cluster_;  // length of the cluster we're in so far
+  size_t total_cluster_;
+  size_t total_displacement_;
+};
+
 template<typename... Ts> struct make_void { typedef void type;};
 template<typename... Ts> using void_t = typename make_void<Ts...>::type;
 
@@ -177,31 +440,31 @@ inline bool write_data(OUTPUT* fp, const void* data, size_t length) {
 template <typename INPUT, typename IntType>
 bool read_bigendian_number(INPUT* fp, IntType* value, size_t length) {
   *value = 0;
-  unsigned char byte;
+  unsigned char bytes[16];
   // We require IntType to be unsigned or else the shifting gets all screwy.
   static_assert(static_cast<IntType>(-1) > static_cast<IntType>(0),
                 "serializing int requires an unsigned type");
-  for (size_t i = 0; i < length; ++i) {
-    if (!read_data(fp, &byte, sizeof(byte))) return false;
-    *value |= static_cast<IntType>(byte) << ((length - 1 - i) * 8);
-  }
+  assert(length <= sizeof(bytes));
+  if (!read_data(fp, bytes, length)) return false;
+  for (size_t i = 0; i < length; ++i)
+    *value |= static_cast<IntType>(bytes[i]) << ((length - 1 - i) * 8);
   return true;
 }
 
 template <typename OUTPUT, typename IntType>
 bool write_bigendian_number(OUTPUT* fp, IntType value, size_t length) {
-  unsigned char byte;
+  unsigned char bytes[16];
   // We require IntType to be unsigned or else the shifting gets all screwy.
   static_assert(static_cast<IntType>(-1) > static_cast<IntType>(0),
                 "serializing int requires an unsigned type");
+  assert(length <= sizeof(bytes));
   for (size_t i = 0; i < length; ++i) {
-    byte = (sizeof(value) <= length - 1 - i)
-               ? 0
-               : static_cast<unsigned char>((value >> ((length - 1 - i) * 8)) &
-                                            255);
-    if (!write_data(fp, &byte, sizeof(byte))) return false;
+    bytes[i] = (sizeof(value) <= length - 1 - i)
+                   ? 0
+                   : static_cast<unsigned char>(
+                         (value >> ((length - 1 - i) * 8)) & 255);
   }
-  return true;
+  return write_data(fp, bytes, length);
 }
 
 // If your keys and values are simple enough, you can pass this
@@ -222,17 +485,215 @@ struct pod_serializer {
   }
 };
 
+// True for pod_serializer<value_type>, whose values the tables can
+// read and write as one run of bytes.
+template <typename Serializer, typename value_type>
+struct is_pod_serializer
+    : std::is_same<Serializer, pod_serializer<value_type>> {};
+
+// The tables serialize through these so that the numbers, bitmaps and
+// POD values they write take a few large read_data()/write_data()
+// calls instead of one each.  Both are custom streams (see above), so
+// read_data(), write_data() and pod_serializer work on them too.  Other
+// serializers may only know how to use the caller's stream, so the
+// tables call them with stream() instead, after flush().
+static const size_t SERIALIZE_BUFFER_SIZE = 64 * 1024;
+
+template <typename OUTPUT>
+class buffered_writer {
+ public:
+  explicit buffered_writer(OUTPUT* fp)
+      : fp_(fp), buffer_(SERIALIZE_BUFFER_SIZE), used_(0) {}
+
+  size_t Write(const void* data, size_t length) {
+    if (length > buffer_.size() - used_) {
+      if (!flush()) return 0;
+      if (length >= buffer_.size())  // no point copying it
+        return write_data(fp_, data, length) ? length : 0;
+    }
+    memcpy(&buffer_[used_], data, length);
+    used_ += length;
+    return length;
+  }
+
+  // Writes out what we have.  Call it before using stream() directly,
+  // and at the end: the destructor doesn't.
+  bool flush() {
+    const size_t used = used_;
+    used_ = 0;
+    return used == 0 || write_data(fp_, &buffer_[0], used);
+  }
+
+  OUTPUT* stream() const { return fp_; }
+
+ private:
+  OUTPUT* fp_;
+  std::vector<char> buffer_;
+  size_t used_;
+};
+
+// Unlike writing, reading ahead could take bytes from the stream that
+// come after the table, so the reader only reads ahead over the bytes
+// it has been told to expect().  Other reads go straight to the stream.
+template <typename INPUT>
+class buffered_reader {
+ public:
+  explicit buffered_reader(INPUT* fp)
+      : fp_(fp), begin_(0), end_(0), expected_(0) {}
+
+  // The next length bytes of the stream, past what we've read ahead
+  // already, are ours to read.
+  void expect(size_t length) { expected_ += length; }
+
+  size_t Read(void* data, size_t length) {
+    char* out = static_cast<char*>(data);
+    size_t done = 0;
+    while (done < length) {
+      if (begin_ == end_) {
+        const size_t want = length - done;
+        if (want >= expected_ || want >= SERIALIZE_BUFFER_SIZE) {
+          if (!read_data(fp_, out + done, want)) return done;
+          expected_ -= want < expected_ ? want : expected_;
+          return length;
+        }
+        const size_t chunk = expected_ < SERIALIZE_BUFFER_SIZE
+                                 ? expected_
+                                 : SERIALIZE_BUFFER_SIZE;
+        buffer_.resize(SERIALIZE_BUFFER_SIZE);
+        if (!read_data(fp_, &buffer_[0], chunk)) return done;
+        begin_ = 0;
+        end_ = chunk;
+        expected_ -= chunk;
+      }
+      size_t n = end_ - begin_;
+      if (n > length - done) n = length - done;
+      memcpy(out + done, &buffer_[begin_], n);
+      begin_ += n;
+      done += n;
+    }
+    return length;
+  }
+
+  // Only valid once everything read ahead has been consumed.
+  INPUT* stream() const {
+    assert(begin_ == end_);
+    return fp_;
+  }
+
+ private:
+  INPUT* fp_;
+  std::vector<char> buffer_;
+  size_t begin_, end_;  // what we've read ahead and not handed out
+  size_t expected_;     // how much more we may read ahead
+};
+
+// Packs the occupied bits of a word of 2-bit bucket states, where a
+// set low bit means occupied, into 32 bits, one per bucket.
+inline uint32_t pack_state_word(uint64_t states) {
+  uint64_t x = states & 0x5555555555555555ULL;
+  x = (x | (x >> 1)) & 0x3333333333333333ULL;
+  x = (x | (x >> 2)) & 0x0F0F0F0F0F0F0F0FULL;
+  x = (x | (x >> 4)) & 0x00FF00FF00FF00FFULL;
+  x = (x | (x >> 8)) & 0x0000FFFF0000FFFFULL;
+  x = (x | (x >> 16)) & 0x00000000FFFFFFFFULL;
+  return static_cast<uint32_t>(x);
+}
+
+// The inverse: 32 occupied bits become a word of 2-bit states.
+inline uint64_t unpack_state_word(uint32_t bits) {
+  uint64_t x = bits;
+  x = (x | (x << 16)) & 0x0000FFFF0000FFFFULL;
+  x = (x | (x << 8)) & 0x00FF00FF00FF00FFULL;
+  x = (x | (x << 4)) & 0x0F0F0F0F0F0F0F0FULL;
+  x = (x | (x << 2)) & 0x3333333333333333ULL;
+  x = (x | (x << 1)) & 0x5555555555555555ULL;
+  return x;
+}
+
+// Returns the index of the lowest set bit of x, which must be non-zero.
+// Used to skip quickly over runs of unused buckets in a state bitmap.
+inline int count_trailing_zeros64(uint64_t x) {
+  assert(x != 0);
+#if defined(__GNUC__)
+  return __builtin_ctzll(x);
+#else
+  int n = 0;
+  while ((x & 1) == 0) {
+    x >>= 1;
+    ++n;
+  }
+  return n;
+#endif
+}
+
+// Asks the CPU to start pulling the cache line at p in, for writing,
+// so that the miss overlaps with other work.  Only a hint.
+inline void prefetch_for_write(const void* p) {
+#if defined(__GNUC__)
+  __builtin_prefetch(p, 1, 3);
+#else
+  (void)p;
+#endif
+}
+
+// Maps h onto [0, n) with a multiply-high instead of a division, as in
+// Lemire's "fastrange".  Only the high bits of h matter, so they had
+// better be well mixed.
+inline uint64_t fastrange64(uint64_t h, uint64_t n) {
+#if defined(__SIZEOF_INT128__)
+  __extension__ typedef unsigned __int128 uint128;
+  return static_cast<uint64_t>((static_cast<uint128>(h) * n) >> 64);
+#else
+  const uint64_t h_lo = h & 0xffffffffu, h_hi = h >> 32;
+  const uint64_t n_lo = n & 0xffffffffu, n_hi = n >> 32;
+  const uint64_t mid = (h_lo * n_lo >> 32) + (h_hi * n_lo & 0xffffffffu) +
+                       (h_lo * n_hi & 0xffffffffu);
+  return h_hi * n_hi + (h_hi * n_lo >> 32) + (h_lo * n_hi >> 32) + (mid >> 32);
+#endif
+}
+inline uint32_t fastrange32(uint32_t h, uint32_t n) {
+  return static_cast<uint32_t>((static_cast<uint64_t>(h) * n) >> 32);
+}
+
+// True if HashFcn has a set_seed(uint64_t) method, which seeded tables
+// call so that keys whose hashes collide outright get different hashes
+// under another seed.  (google::fast_hash<std::string> has one.)
+template <class HashFcn, class = void>
+struct has_set_seed : std::false_type {};
+
+template <class HashFcn>
+struct has_set_seed<HashFcn, void_t<decltype(std::declval<HashFcn&>().set_seed(
+                                 static_cast<uint64_t>(0)))>> : std::true_type {};
+
+// A fresh, hard to guess, non-zero seed for seeded hashing.  It mixes
+// the clock, a counter and an address, which is plenty to keep a
+// client from predicting bucket positions, and is much cheaper than
+// std::random_device.
+inline uint64_t random_hash_seed(const void* salt) {
+  static std::atomic<uint64_t> counter(0);
+  uint64_t x = static_cast<uint64_t>(
+      std::chrono::steady_clock::now().time_since_epoch().count());
+  x ^= reinterpret_cast<uintptr_t>(salt);
+  x += (counter.fetch_add(1, std::memory_order_relaxed) + 1) *
+       0x9E3779B97F4A7C15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;  // splitmix64's finalizer
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x != 0 ? x : 1;
+}
+
 // Settings contains parameters for growing and shrinking the table.
 // It also packages zero-size functor (ie. hasher).
 //
 // It does some munging of the hash value in cases where we think
 // (fear) the original hash function might not be very good.  In
-// particular, the default hash of pointers is the identity hash,
-// so probably all the low bits are 0.  We identify when we think
-// we're hashing a pointer, and chop off the low bits.  Note this
-// isn't perfect: even when the key is a pointer, we can't tell
-// for sure that the hash is the identity hash.  If it's not, this
-// is needless work (and possibly, though not likely, harmful).
+// particular, the default hash of integers and pointers is the
+// identity hash, so keys with a common stride (and all pointers) have
+// the same low bits, and those are the bits that pick the bucket.
+// For integer, enum and pointer keys we run the hash through a
+// multiply-xorshift finalizer, unless the hasher says it doesn't need
+// it (see is_avalanching in <sparsehash/traits>).  For other key
+// types we trust the hasher.
 
 template <typename Key, typename HashFunc, typename SizeType,
           int HT_MIN_BUCKETS>
@@ -253,6 +714,16 @@ class sh_hashtable_settings : public HashFunc {
         consider_shrink_(false),
         use_empty_(false),
         use_deleted_(false),
+        fine_grained_buckets_(false),
+        grow_early_(false),
+        max_buckets_(0),
+        inserts_since_erase_(0),
+        hash_seed_(0),
+        reseed_probe_limit_(0),
+        reseed_pending_(false),
+        inserts_since_reseed_(0),
+        observer_(NULL),
+        observer_arg_(NULL),
         num_ht_copies_(0) {
     set_enlarge_factor(ht_occupancy_flt);
     set_shrink_factor(ht_empty_flt);
@@ -260,9 +731,38 @@ class sh_hashtable_settings : public HashFunc {
 
   template<typename K>
   size_type hash(const K& v) const {
+    return munge_hash(raw_hash(v));
+  }
+
+  // hash() in two steps, for callers that computed hasher::operator()
+  // themselves: raw_hash() is the plain hasher output and munge_hash()
+  // applies the munging and the seed to it.
+  template<typename K>
+  size_t raw_hash(const K& v) const {
+    return hasher::operator()(v);
+  }
+  size_type munge_hash(size_t raw) const {
     // We munge the hash value when we don't trust hasher::operator().
-    return hash_munger<Key>::MungedHash(hasher::operator()(v));
+    const size_t h = hash_munger<Key>::MungedHash(raw);
+    if (hash_seed_ == 0) return h;
+    return FinalizeHash(h ^ static_cast<size_t>(hash_seed_));
+  }
+
+  // Seeded hashing mixes a per-table seed into every hash, so clients
+  // that pick the keys can't aim them all at the same buckets.  A seed
+  // of 0 turns it off.  The caller has to rehash after changing it.
+  uint64_t hash_seed() const { return hash_seed_; }
+  void set_hash_seed(uint64_t seed) {
+    hash_seed_ = seed;
+    reseed_pending_ = false;
+    inserts_since_reseed_ = 0;
+    seed_hasher(seed, has_set_seed<hasher>());
   }
+  // Seeded tables pick a new seed, and rehash, when an insert probes
+  // more than this many buckets; see note_insert_probes().
+  size_type reseed_probe_limit() const { return reseed_probe_limit_; }
+  void set_reseed_probe_limit(size_type n) { reseed_probe_limit_ = n; }
+  bool reseed_pending() const { return reseed_pending_; }
 
   float enlarge_factor() const { return enlarge_factor_; }
   void set_enlarge_factor(float f) { enlarge_factor_ = f; }
@@ -282,7 +782,84 @@ class sh_hashtable_settings : public HashFunc {
   }
 
   bool consider_shrink() const { return consider_shrink_; }
-  void set_consider_shrink(bool t) { consider_shrink_ = t; }
+  void set_consider_shrink(bool t) {
+    consider_shrink_ = t;
+    if (t) inserts_since_erase_ = 0;  // an erase restarts the shrink delay
+  }
+
+  // Counts an insert toward the policy's shrink_delay.  True if the
+  // table may shrink now (that is, if consider_shrink() says it should).
+  bool shrink_delay_passed() {
+    if (inserts_since_erase_ >= policy_.shrink_delay) return true;
+    ++inserts_since_erase_;
+    return false;
+  }
+
+  const resize_policy& policy() const { return policy_; }
+  // bucket_bytes is how much memory each bucket takes, to turn the
+  // policy's byte budget into a bucket count.
+  void set_policy(const resize_policy& p, size_t bucket_bytes) {
+    policy_ = p;
+    max_buckets_ = 0;
+    if (p.max_bytes > 0) {
+      max_buckets_ = static_cast<size_type>(p.max_bytes / bucket_bytes);
+      if (max_buckets_ < HT_MIN_BUCKETS) max_buckets_ = HT_MIN_BUCKETS;
+    }
+  }
+
+  // The next bucket count up from num_buckets, ignoring any budget.
+  size_type grow_step(size_type num_buckets) const {
+    if (num_buckets < HT_MIN_BUCKETS) return HT_MIN_BUCKETS;
+    const double factor = policy_.growth_factor > 1.0f
+                              ? policy_.growth_factor
+                              : (fine_grained_buckets_ ? 1.25 : 2.0);
+    const double next = num_buckets * factor;
+    if (next >= static_cast<double>((std::numeric_limits<size_type>::max)()))
+      throw std::length_error("resize overflow");
+    size_type sz = static_cast<size_type>(next);
+    if (sz <= num_buckets) sz = num_buckets + 1;
+    if (!fine_grained_buckets_) {  // round up to a power of two
+      size_type pow2 = num_buckets;
+      while (pow2 < sz) {
+        if (static_cast<size_type>(pow2 * 2) < pow2)
+          throw std::length_error("resize overflow");
+        pow2 *= 2;
+      }
+      sz = pow2;
+    }
+    return sz;
+  }
+
+  // True if growing num_buckets another step would go over the budget.
+  bool at_budget(size_type num_buckets) const {
+    return max_buckets_ > 0 &&
+           (num_buckets >= max_buckets_ || grow_step(num_buckets) > max_buckets_);
+  }
+
+  // An insert that just took num_probes probes can ask for the next
+  // insert to grow the table; see resize_policy::max_probe_length.
+  void note_insert_probes(size_type num_probes, size_type num_elts,
+                          size_type num_buckets) {
+#ifdef SPARSEHASH_COLLECT_STATS
+    ++counters_.inserts;
+    counters_.insert_probes += num_probes;
+#endif
+    if (policy_.max_probe_length > 0 && num_probes > policy_.max_probe_length &&
+        num_elts >= enlarge_threshold_ / 2 && !at_budget(num_buckets))
+      grow_early_ = true;
+    // Honest keys almost never probe this far, so under a random seed
+    // this is someone attacking the hash function: change the seed.  A
+    // table full up to its memory budget probes far anyway.  Keys whose
+    // hashes are identical under every seed would make us reseed on
+    // every insert, so we wait for size/2 inserts between reseeds,
+    // which keeps the rehashing to O(1) per insert.
+    ++inserts_since_reseed_;
+    if (hash_seed_ != 0 && reseed_probe_limit_ > 0 &&
+        num_probes > reseed_probe_limit_ && !at_budget(num_buckets) &&
+        inserts_since_reseed_ >= num_elts / 2)
+      reseed_pending_ = true;
+  }
+  bool grow_early() const { return grow_early_; }
 
   bool use_empty() const { return use_empty_; }
   void set_use_empty(bool t) { use_empty_ = t; }
@@ -290,17 +867,119 @@ class sh_hashtable_settings : public HashFunc {
   bool use_deleted() const { return use_deleted_; }
   void set_use_deleted(bool t) { use_deleted_ = t; }
 
+  // By default, bucket counts are powers of two, so growing the table
+  // doubles its size.  With fine-grained buckets, bucket counts grow by
+  // about a quarter at a time instead, and hashes are mapped to buckets
+  // with fastrange.  The caller has to rehash when changing this.
+  bool fine_grained_buckets() const { return fine_grained_buckets_; }
+  void set_fine_grained_buckets(bool t) { fine_grained_buckets_ = t; }
+
+  // The first bucket to probe for a (munged) hash value, in a table of
+  // num_buckets buckets.
+  size_type bucket_for_hash(size_type h, size_type num_buckets) const {
+    if (!fine_grained_buckets_) return h & (num_buckets - 1);
+    // fastrange uses the high bits, which identity hashes leave at 0,
+    // so spread the low bits upward with a Fibonacci multiply first.
+    if (sizeof(size_type) <= 4) {
+      return static_cast<size_type>(
+          fastrange32(static_cast<uint32_t>(h) * 0x9E3779B9u,
+                      static_cast<uint32_t>(num_buckets)));
+    }
+    return static_cast<size_type>(fastrange64(
+        static_cast<uint64_t>(h) * 0x9E3779B97F4A7C15ULL, num_buckets));
+  }
+
+  void set_resize_observer(resize_observer observer, void* arg) {
+    observer_ = observer;
+    observer_arg_ = arg;
+  }
+
+  // A table calls these just before and just after each rehash.
+  // rehash_begin() returns the time to pass to rehash_end(); we only
+  // read the clock if there is an observer.
+  uint64_t rehash_begin(const void* table, resize_event::reason_type reason,
+                        size_type old_buckets, size_type new_buckets,
+                        size_type num_elts) const {
+    SPARSEHASH_TRACE_REHASH(begin, table, reason, old_buckets, new_buckets,
+                            num_elts);
+    if (observer_ == NULL) return 0;
+    const resize_event event = {reason, false, table, old_buckets,
+                                new_buckets, num_elts, 0};
+    observer_(event, observer_arg_);
+    return now_ns();
+  }
+  void rehash_end(const void* table, resize_event::reason_type reason,
+                  size_type old_buckets, size_type new_buckets,
+                  size_type num_elts, uint64_t start_ns) const {
+    SPARSEHASH_TRACE_REHASH(end, table, reason, old_buckets, new_buckets,
+                            num_elts);
+    if (observer_ == NULL) return;
+    const resize_event event = {reason, true, table, old_buckets,
+                                new_buckets, num_elts, now_ns() - start_ns};
+    observer_(event, observer_arg_);
+  }
+
   size_type num_ht_copies() const {
     return static_cast<size_type>(num_ht_copies_);
   }
   void inc_num_ht_copies() { ++num_ht_copies_; }
 
+  // These update counters() if SPARSEHASH_COLLECT_STATS is defined, and
+  // compile to nothing if it isn't.
+  void count_lookup(size_type num_probes) const {
+#ifdef SPARSEHASH_COLLECT_STATS
+    lookups_.add(1);
+    lookup_probes_.add(num_probes);
+    probe_histogram_[probe_histogram_slot(num_probes)].add(1);
+#else
+    (void)num_probes;
+#endif
+  }
+  void count_rehash(size_type old_buckets, size_type new_buckets,
+                    size_t bytes) {
+#ifdef SPARSEHASH_COLLECT_STATS
+    if (new_buckets > old_buckets)
+      ++counters_.grows;
+    else if (new_buckets < old_buckets)
+      ++counters_.shrinks;
+    else
+      ++counters_.rehashes;
+    counters_.bytes_moved += bytes;
+#else
+    (void)old_buckets;
+    (void)new_buckets;
+    (void)bytes;
+#endif
+  }
+#ifdef SPARSEHASH_COLLECT_STATS
+  hashtable_counters counters() const {
+    hashtable_counters counters = counters_;
+    counters.lookups = lookups_.get();
+    counters.lookup_probes = lookup_probes_.get();
+    for (int i = 0; i < kProbeHistogramSize; ++i)
+      counters.probe_histogram[i] = probe_histogram_[i].get();
+    return counters;
+  }
+  void reset_counters() {
+    counters_ = hashtable_counters();
+    lookups_ = relaxed_counter();
+    lookup_probes_ = relaxed_counter();
+    for (int i = 0; i < kProbeHistogramSize; ++i)
+      probe_histogram_[i] = relaxed_counter();
+  }
+#endif
+
   // Reset the enlarge and shrink thresholds
   void reset_thresholds(size_type num_buckets) {
-    set_enlarge_threshold(enlarge_size(num_buckets));
+    // A table at its memory budget fills up instead of growing, keeping
+    // just one empty bucket so probes still end.
+    set_enlarge_threshold(at_budget(num_buckets) && num_buckets > 0
+                              ? num_buckets - 1
+                              : enlarge_size(num_buckets));
     set_shrink_threshold(shrink_size(num_buckets));
     // whatever caused us to reset already considered
     set_consider_shrink(false);
+    grow_early_ = false;
   }
 
   // Caller is resposible for calling reset_threshold right after
@@ -316,40 +995,62 @@ class sh_hashtable_settings : public HashFunc {
 
   // This is the smallest size a hashtable can be without being too crowded
   // If you like, you can give a min #buckets as well as a min #elts
+  // Under a memory budget, this stops at the biggest size the budget
+  // allows, even if that is too crowded; callers must check that it
+  // still has room.
   size_type min_buckets(size_type num_elts, size_type min_buckets_wanted) {
     float enlarge = enlarge_factor();
     size_type sz = HT_MIN_BUCKETS;  // min buckets allowed
     while (sz < min_buckets_wanted ||
            num_elts >= static_cast<size_type>(sz * enlarge)) {
-      // This just prevents overflowing size_type, since sz can exceed
-      // max_size() here.
-      if (static_cast<size_type>(sz * 2) < sz) {
-        throw std::length_error("resize overflow");  // protect against overflow
-      }
-      sz *= 2;
+      if (at_budget(sz)) break;
+      // grow_step() throws rather than overflowing size_type, since sz
+      // can exceed max_size() here.  Fine-grained sizes go 4, 5, 6, 7,
+      // 8, 10, 12, 15, ...; the others double.
+      sz = grow_step(sz);
     }
     return sz;
   }
 
  private:
-  template <class HashKey>
+  // One multiply spreads the low bits of the hash upward, and the
+  // xorshift brings the high bits back down to where the bucket index
+  // comes from.
+  static size_t FinalizeHash(size_t hash) {
+    const uint64_t h = static_cast<uint64_t>(hash) * 0x9E3779B97F4A7C15ULL;
+    return static_cast<size_t>(h ^ (h >> 32));
+  }
+
+  static uint64_t now_ns() {
+    return static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch())
+            .count());
+  }
+
+  void seed_hasher(uint64_t seed, std::true_type) {
+    hasher::set_seed(seed);
+  }
+  void seed_hasher(uint64_t, std::false_type) {}
+
+  template <class HashKey, class = void>
   class hash_munger {
    public:
     static size_t MungedHash(size_t hash) { return hash; }
   };
-  // This matches when the hashtable key is a pointer.
+  // This matches when the hashtable key is an integer, enum or pointer,
+  // or a packed one, and the hasher isn't known to be good.
+  template <class HashKey, class Hashed = typename hashed_key_type<HashKey>::type>
+  struct is_weakly_hashed
+      : std::integral_constant<bool, (std::is_integral<Hashed>::value ||
+                                      std::is_enum<Hashed>::value ||
+                                      std::is_pointer<Hashed>::value) &&
+                                         !is_avalanching<HashFunc>::value> {};
   template <class HashKey>
-  class hash_munger<HashKey*> {
+  class hash_munger<
+      HashKey, typename std::enable_if<is_weakly_hashed<HashKey>::value>::type> {
    public:
-    static size_t MungedHash(size_t hash) {
-      // TODO(csilvers): consider rotating instead:
-      //    static const int shift = (sizeof(void *) == 4) ? 2 : 3;
-      //    return (hash << (sizeof(hash) * 8) - shift)) | (hash >>
-      //    shift);
-      // This matters if we ever change sparse/dense_hash_* to compare
-      // hashes before comparing actual values.  It's speedy on x86.
-      return hash / sizeof(void*);  // get rid of known-0 bits
-    }
+    static size_t MungedHash(size_t hash) { return FinalizeHash(hash); }
   };
 
   size_type enlarge_threshold_;  // table.size() * enlarge_factor
@@ -360,8 +1061,26 @@ class sh_hashtable_settings : public HashFunc {
   bool consider_shrink_;
   bool use_empty_;    // used only by densehashtable, not sparsehashtable
   bool use_deleted_;  // false until delkey has been set
+  bool fine_grained_buckets_;  // bucket counts needn't be powers of two
+  bool grow_early_;  // an insert probed too long, so grow on the next one
+  resize_policy policy_;
+  size_type max_buckets_;  // from policy_.max_bytes; 0 if there's no budget
+  size_t inserts_since_erase_;  // counts toward policy_.shrink_delay
+  uint64_t hash_seed_;           // 0 unless seeded hashing is on
+  size_type reseed_probe_limit_;  // 0 never reseeds
+  bool reseed_pending_;  // an insert probed too long, so reseed
+  size_t inserts_since_reseed_;  // reseeds are at least size/2 apart
+  resize_observer observer_;  // NULL if nobody's listening
+  void* observer_arg_;
   // num_ht_copies is a counter incremented every Copy/Move
   unsigned int num_ht_copies_;
+#ifdef SPARSEHASH_COLLECT_STATS
+  // Writers count in counters_; const lookups in the relaxed_counters.
+  hashtable_counters counters_;
+  relaxed_counter lookups_;
+  relaxed_counter lookup_probes_;
+  relaxed_counter probe_histogram_[kProbeHistogramSize];
+#endif
 };
 
 }  // namespace sparsehash_internal
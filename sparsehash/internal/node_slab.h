@@ -0,0 +1,165 @@
+// Copyright (c) 2006, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// ---
+//
+// A slab allocator for the values of dense_node_hash_map.  Values are
+// carved out of blocks of slots that never move, so a pointer to a
+// value stays good until the value is destroyed.  Destroyed slots go
+// on a free list and are reused before we carve out any more.  Blocks
+// start small and double up to kMaxBlockSlots slots; they are only
+// given back by release() (or the destructor), once every value in
+// them has been destroyed.
+
+#pragma once
+
+#include <cassert>
+#include <cstddef>      // for size_t
+#include <memory>       // for allocator_traits
+#include <new>          // for placement new
+#include <type_traits>  // for aligned_storage
+#include <utility>      // for forward, swap
+
+namespace google {
+namespace sparsehash_internal {
+
+template <class Value, class Alloc>
+class node_slab {
+ private:
+  union slot {
+    slot* next;  // while the slot is free
+    typename std::aligned_storage<sizeof(Value), alignof(Value)>::type value;
+  };
+  // Each block starts with two header slots, which link it to the
+  // previous block and say how big it is, followed by the value slots.
+  union block_header {
+    slot* prev_block;
+    size_t num_slots;
+  };
+  typedef
+      typename std::allocator_traits<Alloc>::template rebind_alloc<slot>
+          slot_alloc_type;
+
+  static const size_t kMinBlockSlots = 16;
+  static const size_t kMaxBlockSlots = 1024;
+
+ public:
+  explicit node_slab(const Alloc& a = Alloc())
+      : alloc_(a),
+        free_list_(NULL),
+        blocks_(NULL),
+        next_(NULL),
+        end_(NULL),
+        block_slots_(kMinBlockSlots) {}
+  ~node_slab() { release(); }
+
+  node_slab(const node_slab&) = delete;
+  node_slab& operator=(const node_slab&) = delete;
+
+  Alloc get_allocator() const { return Alloc(alloc_); }
+
+  // Builds a Value from args in a free slot.  Throws whatever Value's
+  // constructor or the allocator throws, in which case nothing changes.
+  template <typename... Args>
+  Value* construct(Args&&... args) {
+    slot* s = take_slot();
+    try {
+      return ::new (static_cast<void*>(&s->value))
+          Value(std::forward<Args>(args)...);
+    } catch (...) {
+      give_back(s);
+      throw;
+    }
+  }
+
+  void destroy(Value* v) {
+    v->~Value();
+    give_back(reinterpret_cast<slot*>(v));
+  }
+
+  // Frees every block.  All values must have been destroyed already.
+  void release() {
+    while (blocks_ != NULL) {
+      block_header* header = reinterpret_cast<block_header*>(blocks_);
+      slot* prev = header[0].prev_block;
+      alloc_.deallocate(blocks_, header[1].num_slots + 2);
+      blocks_ = prev;
+    }
+    free_list_ = next_ = end_ = NULL;
+    block_slots_ = kMinBlockSlots;
+  }
+
+  void swap(node_slab& other) {
+    using std::swap;
+    swap(alloc_, other.alloc_);
+    swap(free_list_, other.free_list_);
+    swap(blocks_, other.blocks_);
+    swap(next_, other.next_);
+    swap(end_, other.end_);
+    swap(block_slots_, other.block_slots_);
+  }
+
+ private:
+  slot* take_slot() {
+    if (free_list_ != NULL) {
+      slot* s = free_list_;
+      free_list_ = s->next;
+      return s;
+    }
+    if (next_ == end_) add_block();
+    return next_++;
+  }
+
+  void give_back(slot* s) {
+    s->next = free_list_;
+    free_list_ = s;
+  }
+
+  void add_block() {
+    // Two header slots: the link to the previous block and our size.
+    slot* block = alloc_.allocate(block_slots_ + 2);
+    block_header* header = reinterpret_cast<block_header*>(block);
+    header[0].prev_block = blocks_;
+    header[1].num_slots = block_slots_;
+    blocks_ = block;
+    next_ = block + 2;
+    end_ = next_ + block_slots_;
+    if (block_slots_ < kMaxBlockSlots) block_slots_ *= 2;
+  }
+
+  slot_alloc_type alloc_;
+  slot* free_list_;    // destroyed slots, ready for reuse
+  slot* blocks_;       // the newest block; each links to the one before
+  slot* next_;         // the next never-used slot in the newest block
+  slot* end_;          // the end of the newest block
+  size_t block_slots_;  // how many slots the next block gets
+};
+
+}  // namespace sparsehash_internal
+}  // namespace google
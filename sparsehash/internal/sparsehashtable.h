@@ -105,6 +105,8 @@
 #include <sparsehash/sparsetable>  // IWYU pragma: export
 #include <stdexcept>               // For length_error
 #include <tuple>        // For forward_as_tuple
+#include <vector>       // for parallel_reduce()'s partial results
+#include <sparsehash/internal/thread_executor.h>
 
 namespace google {
 
@@ -458,6 +460,34 @@ class sparse_hashtable {
 
   // Accessor function for statistics gathering.
   int num_table_copies() const { return settings.num_ht_copies(); }
+#ifdef SPARSEHASH_COLLECT_STATS
+  hashtable_counters counters() const { return settings.counters(); }
+  void reset_counters() { settings.reset_counters(); }
+#endif
+
+  // Walks every bucket to see how crowded the table is; see
+  // hashtable_stats in hashtable-common.h.
+  hashtable_stats compute_stats() const {
+    sparsehash_internal::stats_scanner scanner;
+    for (size_type i = 0; i < bucket_count(); ++i) {
+      if (!table.test(i)) {
+        scanner.empty_bucket();
+      } else if (test_deleted(i)) {
+        scanner.deleted_bucket();
+      } else {
+        // Retrace find()'s probes, without comparing keys.
+        size_type num_probes = 0;
+        for (size_type bucknum =
+                 first_bucket(hash(get_key(table.unsafe_get(i))));
+             bucknum != i; bucknum = next_bucket(bucknum, num_probes)) {
+          ++num_probes;
+          assert(num_probes < bucket_count());
+        }
+        scanner.element(num_probes);
+      }
+    }
+    return scanner.finish(size(), bucket_count(), num_deleted);
+  }
 
  private:
   // We need to copy values when we set the special marker for deleted
@@ -485,8 +515,7 @@ class sparse_hashtable {
  private:
   void squash_deleted() {  // gets rid of any deleted entries we have
     if (num_deleted) {     // get rid of deleted before writing
-      sparse_hashtable tmp(MoveDontGrow, *this);
-      swap(tmp);  // now we are tmp
+      rehash_to(MoveDontGrow, bucket_count(), resize_event::SQUASH_DELETED);
     }
     assert(num_deleted == 0);
   }
@@ -603,7 +632,8 @@ class sparse_hashtable {
   // done after shrinking.  Maybe make part of the Settings class?
   bool maybe_shrink() {
     assert(table.num_nonempty() >= num_deleted);
-    assert((bucket_count() & (bucket_count() - 1)) == 0);  // is a power of two
+    assert(settings.fine_grained_buckets() ||
+           (bucket_count() & (bucket_count() - 1)) == 0);  // a power of two
     assert(bucket_count() >= HT_MIN_BUCKETS);
     bool retval = false;
 
@@ -620,10 +650,9 @@ class sparse_hashtable {
       size_type sz = bucket_count() / 2;  // find how much we should shrink
       while (sz > HT_DEFAULT_STARTING_BUCKETS &&
              num_remain < static_cast<size_type>(sz * shrink_factor)) {
-        sz /= 2;  // stay a power of 2
+        sz /= 2;  // stay a power of 2 (unless fine-grained; see min_buckets)
       }
-      sparse_hashtable tmp(MoveDontCopy, *this, sz);
-      swap(tmp);  // now we are tmp
+      rehash_to(MoveDontCopy, sz, resize_event::SHRINK);
       retval = true;
     }
     settings.set_consider_shrink(false);  // because we just considered it
@@ -636,7 +665,12 @@ class sparse_hashtable {
   // Returns true if we actually resized, false if size was already ok.
   bool resize_delta(size_type delta) {
     bool did_resize = false;
-    if (settings.consider_shrink()) {  // see if lots of deletes happened
+    if (settings.reseed_pending()) {  // see set_seeded_hashing()
+      set_hash_seed(sparsehash_internal::random_hash_seed(this));
+      did_resize = true;
+    }
+    if (settings.consider_shrink() &&  // see if lots of deletes happened
+        settings.shrink_delay_passed()) {
       if (maybe_shrink()) did_resize = true;
     }
     if (table.num_nonempty() >=
@@ -644,7 +678,8 @@ class sparse_hashtable {
       throw std::length_error("resize overflow");
     }
     if (bucket_count() >= HT_MIN_BUCKETS &&
-        (table.num_nonempty() + delta) <= settings.enlarge_threshold())
+        (table.num_nonempty() + delta) <= settings.enlarge_threshold() &&
+        !settings.grow_early())
       return did_resize;  // we're ok as we are
 
     // Sometimes, we need to resize just to get rid of all the
@@ -653,15 +688,26 @@ class sparse_hashtable {
     // are currently taking up room).  But later, when we decide what
     // size to resize to, *don't* count deleted buckets, since they
     // get discarded during the resize.
-    const size_type needed_size =
+    size_type needed_size =
         settings.min_buckets(table.num_nonempty() + delta, 0);
-    if (needed_size <= bucket_count())  // we have enough buckets
+    if (settings.grow_early())  // an insert probed too long; see resize_policy
+      needed_size = settings.min_buckets(0, bucket_count() + 1);
+    // (Under a memory budget, needed_size may be too small after all.)
+    if (needed_size <= bucket_count() &&
+        table.num_nonempty() + delta < bucket_count())  // enough buckets
       return did_resize;
 
     size_type resize_to = settings.min_buckets(
         table.num_nonempty() - num_deleted + delta, bucket_count());
+    if (settings.grow_early() && resize_to < needed_size)
+      resize_to = needed_size;
+    if (table.num_nonempty() - num_deleted + delta >= resize_to) {
+      // We'd need more buckets than the memory budget allows.
+      throw std::length_error("resize exceeds memory budget");
+    }
     if (resize_to < needed_size &&  // may double resize_to
-        resize_to < (std::numeric_limits<size_type>::max)() / 2) {
+        resize_to < (std::numeric_limits<size_type>::max)() / 2 &&
+        !settings.at_budget(resize_to)) {
       // This situation means that we have enough deleted elements,
       // that once we purge them, we won't actually have needed to
       // grow.  But we may want to grow anyway: if we just purge one
@@ -669,20 +715,37 @@ class sparse_hashtable {
       // insert.  Might as well grow now, since we're already going
       // through the trouble of copying (in order to purge the
       // deleted elements).
+      const size_type next = settings.grow_step(resize_to);
       const size_type target =
-          static_cast<size_type>(settings.shrink_size(resize_to * 2));
+          static_cast<size_type>(settings.shrink_size(next));
       if (table.num_nonempty() - num_deleted + delta >= target) {
         // Good, we won't be below the shrink threshhold even if we
         // double.
-        resize_to *= 2;
+        resize_to = next;
       }
     }
 
-    sparse_hashtable tmp(MoveDontCopy, *this, resize_to);
-    swap(tmp);  // now we are tmp
+    rehash_to(MoveDontCopy, resize_to, resize_event::RESIZE);
     return true;
   }
 
+  // Moves everything into a new table of at least min_buckets_wanted
+  // buckets, which then becomes us.  This is the only place we rehash
+  // in place, so it tells the resize observer and the tracepoints.
+  void rehash_to(MoveDontCopyT mover, size_type min_buckets_wanted,
+                 resize_event::reason_type reason) {
+    const size_type old_buckets = bucket_count();
+    const size_type new_buckets =
+        mover == MoveDontGrow ? old_buckets
+                              : settings.min_buckets(size(), min_buckets_wanted);
+    const uint64_t start = settings.rehash_begin(this, reason, old_buckets,
+                                                 new_buckets, size());
+    sparse_hashtable tmp(mover, *this, min_buckets_wanted);
+    swap(tmp);  // now we are tmp
+    settings.rehash_end(this, reason, old_buckets, bucket_count(), size(),
+                        start);
+  }
+
   // Used to actually do the rehashing when we grow/shrink a hashtable
   void copy_from(const sparse_hashtable& ht, size_type min_buckets_wanted) {
     clear();  // clear table, set num_deleted to 0
@@ -698,15 +761,16 @@ class sparse_hashtable {
     // We use a normal iterator to get non-deleted bcks from ht
     // We could use insert() here, but since we know there are
     // no duplicates and no deleted items, we can be more efficient
-    assert((bucket_count() & (bucket_count() - 1)) == 0);  // a power of two
+    assert(settings.fine_grained_buckets() ||
+           (bucket_count() & (bucket_count() - 1)) == 0);  // a power of two
+    settings.count_rehash(ht.bucket_count(), bucket_count(),
+                          ht.size() * sizeof(value_type));
     for (const_iterator it = ht.begin(); it != ht.end(); ++it) {
       size_type num_probes = 0;  // how many times we've probed
       size_type bucknum;
-      const size_type bucket_count_minus_one = bucket_count() - 1;
-      for (bucknum = hash(get_key(*it)) & bucket_count_minus_one;
+      for (bucknum = first_bucket(hash(get_key(*it)));
            table.test(bucknum);  // not empty
-           bucknum =
-               (bucknum + JUMP_(key, num_probes)) & bucket_count_minus_one) {
+           bucknum = next_bucket(bucknum, num_probes)) {
         ++num_probes;
         assert(num_probes < bucket_count() &&
                "Hashtable is full: an error in key_equal<> or hash<>");
@@ -737,16 +801,18 @@ class sparse_hashtable {
     // We use a normal iterator to get non-deleted bcks from ht
     // We could use insert() here, but since we know there are
     // no duplicates and no deleted items, we can be more efficient
-    assert((bucket_count() & (bucket_count() - 1)) == 0);  // a power of two
+    assert(settings.fine_grained_buckets() ||
+           (bucket_count() & (bucket_count() - 1)) == 0);  // a power of two
+    settings.count_rehash(ht.bucket_count(), bucket_count(),
+                          ht.size() * sizeof(value_type));
     // THIS IS THE MAJOR LINE THAT DIFFERS FROM COPY_FROM():
     for (destructive_iterator it = ht.destructive_begin();
          it != ht.destructive_end(); ++it) {
       size_type num_probes = 0;  // how many times we've probed
       size_type bucknum;
-      for (bucknum = hash(get_key(*it)) & (bucket_count() - 1);  // h % buck_cnt
-           table.test(bucknum);                                  // not empty
-           bucknum =
-               (bucknum + JUMP_(key, num_probes)) & (bucket_count() - 1)) {
+      for (bucknum = first_bucket(hash(get_key(*it)));  // h % buck_cnt
+           table.test(bucknum);                         // not empty
+           bucknum = next_bucket(bucknum, num_probes)) {
         ++num_probes;
         assert(num_probes < bucket_count() &&
                "Hashtable is full: an error in key_equal<> or hash<>");
@@ -780,6 +846,52 @@ class sparse_hashtable {
     settings.reset_thresholds(bucket_count());
   }
 
+  // Tunes when we grow and shrink; see resize_policy in
+  // hashtable-common.h.  A byte budget is counted as if every bucket
+  // held a value, which overstates what a sparse table uses.
+  const resize_policy& get_resize_policy() const { return settings.policy(); }
+  void set_resize_policy(const resize_policy& policy) {
+    settings.set_policy(policy, sizeof(value_type));
+    settings.reset_thresholds(bucket_count());
+  }
+
+  // observer, if not NULL, is called with arg just before and just
+  // after every rehash; see resize_event in hashtable-common.h.
+  void set_resize_observer(resize_observer observer, void* arg = NULL) {
+    settings.set_resize_observer(observer, arg);
+  }
+
+  // By default bucket_count() is a power of two, so the table doubles
+  // when it grows.  With fine-grained buckets it grows by about a
+  // quarter instead.  Changing this rehashes the table.
+  bool fine_grained_buckets() const { return settings.fine_grained_buckets(); }
+  void set_fine_grained_buckets(bool fine) {
+    if (fine == settings.fine_grained_buckets()) return;
+    settings.set_fine_grained_buckets(fine);
+    rehash_to(MoveDontCopy, bucket_count(), resize_event::REHASH);
+  }
+
+  // Seeded hashing mixes a random per-table seed into every hash, for
+  // tables whose keys come from clients who might pick keys that all
+  // land in the same buckets.  When an insert then probes more than
+  // reseed_probe_limit buckets, the next insert picks a new seed and
+  // rehashes, so such keys can't keep lookups slow.  Hash functions
+  // with a set_seed(uint64_t) method get the seed too, which also
+  // breaks up keys with identical hashes.  Changing this rehashes.
+  bool seeded_hashing() const { return settings.hash_seed() != 0; }
+  void set_seeded_hashing(bool seeded, size_type reseed_probe_limit = 64) {
+    settings.set_reseed_probe_limit(seeded ? reseed_probe_limit : 0);
+    set_hash_seed(seeded ? sparsehash_internal::random_hash_seed(this) : 0);
+  }
+  // The seed is part of the hash function, so to unserialize() a seeded
+  // table, first give the new table the old one's seed.  0 is unseeded.
+  uint64_t hash_seed() const { return settings.hash_seed(); }
+  void set_hash_seed(uint64_t seed) {
+    if (seed == settings.hash_seed()) return;
+    settings.set_hash_seed(seed);
+    rehash_to(MoveDontCopy, bucket_count(), resize_event::REHASH);
+  }
+
   // CONSTRUCTORS -- as required by the specs, we take a size,
   // but also let you specify a hashfunction, key comparator,
   // and key extractor.  We also define a copy constructor and =.
@@ -862,15 +974,25 @@ class sparse_hashtable {
   // Note: because of deletions where-to-insert is not trivial: it's the
   // first deleted bucket we see, as long as we don't find the key later
   template <typename K>
-  std::pair<size_type, size_type> find_position(const K& key) const {
+  // If probes is non-NULL, it is set to how many probes it took.
+  std::pair<size_type, size_type> find_position(const K& key,
+                                                size_type* probes = NULL) const {
+    return find_position_with_hash(key, hash(key), probes);
+  }
+
+  // Same, but the caller already has hash(key), munged and seeded.
+  template <typename K>
+  std::pair<size_type, size_type> find_position_with_hash(
+      const K& key, size_type key_hash, size_type* probes = NULL) const {
     size_type num_probes = 0;  // how many times we've probed
-    const size_type bucket_count_minus_one = bucket_count() - 1;
-    size_type bucknum = hash(key) & bucket_count_minus_one;
+    size_type bucknum = first_bucket(key_hash);
     size_type insert_pos = ILLEGAL_BUCKET;  // where we would insert
     SPARSEHASH_STAT_UPDATE(total_lookups += 1);
     while (1) {                    // probe until something happens
       if (!table.test(bucknum)) {  // bucket is empty
         SPARSEHASH_STAT_UPDATE(total_probes += num_probes);
+        if (probes) *probes = num_probes;
+        settings.count_lookup(num_probes);
         if (insert_pos == ILLEGAL_BUCKET)  // found no prior place to insert
           return std::pair<size_type, size_type>(ILLEGAL_BUCKET, bucknum);
         else
@@ -879,10 +1001,12 @@ class sparse_hashtable {
         if (insert_pos == ILLEGAL_BUCKET) insert_pos = bucknum;
       } else if (equals(key, get_key(table.unsafe_get(bucknum)))) {
         SPARSEHASH_STAT_UPDATE(total_probes += num_probes);
+        if (probes) *probes = num_probes;
+        settings.count_lookup(num_probes);
         return std::pair<size_type, size_type>(bucknum, ILLEGAL_BUCKET);
       }
       ++num_probes;  // we're doing another probe
-      bucknum = (bucknum + JUMP_(key, num_probes)) & bucket_count_minus_one;
+      bucknum = next_bucket(bucknum, num_probes);
       assert(num_probes < bucket_count() &&
              "Hashtable is full: an error in key_equal<> or hash<>");
     }
@@ -947,6 +1071,52 @@ class sparse_hashtable {
     }
   }
 
+  // Lookups with a precomputed hash.  hash_function_value() is what the
+  // hasher returns for key, before we munge or seed it; compute it once
+  // and pass it to find(), count(), insert_with_hash() or erase() to
+  // avoid hashing the key again.  The value is only good for tables
+  // whose hasher is the same as this one's.
+  template <typename K>
+  size_t hash_function_value(const K& key) const {
+    return settings.raw_hash(key);
+  }
+
+  template <typename K>
+  iterator find(const K& key, size_t key_hash) {
+    assert(key_hash == hash_function_value(key) && "Wrong precomputed hash");
+    if (size() == 0) return end();
+    std::pair<size_type, size_type> pos =
+        find_position_with_hash(key, settings.munge_hash(key_hash));
+    if (pos.first == ILLEGAL_BUCKET)  // alas, not there
+      return end();
+    else
+      return iterator(this, table.get_iter(pos.first), table.nonempty_end());
+  }
+
+  template <typename K>
+  const_iterator find(const K& key, size_t key_hash) const {
+    assert(key_hash == hash_function_value(key) && "Wrong precomputed hash");
+    if (size() == 0) return end();
+    std::pair<size_type, size_type> pos =
+        find_position_with_hash(key, settings.munge_hash(key_hash));
+    if (pos.first == ILLEGAL_BUCKET)  // alas, not there
+      return end();
+    else
+      return const_iterator(this, table.get_iter(pos.first),
+                            table.nonempty_end());
+  }
+
+  template <typename K>
+  size_type count(const K& key, size_t key_hash) const {
+    return find(key, key_hash) == end() ? 0 : 1;
+  }
+
+  // Starts loading the group of the bucket a lookup of the key with this
+  // hash_function_value() would probe first.  Only a hint.
+  void prefetch(size_t key_hash) const {
+    table.prefetch(first_bucket(settings.munge_hash(key_hash)));
+  }
+
   // INSERTION ROUTINES
  private:
   // Private method used by insert_noresize and find_or_insert.
@@ -981,16 +1151,26 @@ class sparse_hashtable {
 
   // If you know *this is big enough to hold obj, use this routine
   std::pair<iterator, bool> insert_noresize(const_reference obj) {
+    return insert_noresize_with_hash(hash(get_key(obj)), obj);
+  }
+
+  // Same, but key_hash is hash(get_key(obj)), munged and seeded.
+  std::pair<iterator, bool> insert_noresize_with_hash(size_type key_hash,
+                                                      const_reference obj) {
     // First, double-check we're not inserting delkey
     assert(
         (!settings.use_deleted() || !equals(get_key(obj), key_info.delkey)) &&
         "Inserting the deleted key");
-    const std::pair<size_type, size_type> pos = find_position(get_key(obj));
+    size_type num_probes;
+    const std::pair<size_type, size_type> pos =
+        find_position_with_hash(get_key(obj), key_hash, &num_probes);
     if (pos.first != ILLEGAL_BUCKET) {  // object was already there
       return std::pair<iterator, bool>(
           iterator(this, table.get_iter(pos.first), table.nonempty_end()),
           false);  // false: we didn't insert
     } else {       // pos.second says where to put it
+      settings.note_insert_probes(num_probes, table.num_nonempty(),
+                                  bucket_count());
       return std::pair<iterator, bool>(insert_at(obj, pos.second), true);
     }
   }
@@ -1001,12 +1181,15 @@ class sparse_hashtable {
     assert(
         (!settings.use_deleted() || !equals(key, key_info.delkey)) &&
         "Inserting the deleted key");
-    const std::pair<size_type, size_type> pos = find_position(key);
+    size_type num_probes;
+    const std::pair<size_type, size_type> pos = find_position(key, &num_probes);
     if (pos.first != ILLEGAL_BUCKET) {  // object was already there
       return std::pair<iterator, bool>(
           iterator(this, table.get_iter(pos.first), table.nonempty_end()),
           false);  // false: we didn't insert
     } else {       // pos.second says where to put it
+      settings.note_insert_probes(num_probes, table.num_nonempty(),
+                                  bucket_count());
       return std::pair<iterator, bool>(
         emplace_at(pos.second, std::forward<Args>(args)...),
         true);
@@ -1040,6 +1223,18 @@ class sparse_hashtable {
     return insert_noresize(obj);
   }
 
+  // Insert with the precomputed hash_function_value() of obj's key.
+  std::pair<iterator, bool> insert_with_hash(const_reference obj,
+                                             size_t key_hash) {
+    assert(key_hash == hash_function_value(get_key(obj)) &&
+           "Wrong precomputed hash");
+    const uint64_t seed = hash_seed();
+    resize_delta(1);  // adding an object, grow if need be
+    if (hash_seed() != seed)  // we reseeded, and the hasher may be seeded too
+      key_hash = hash_function_value(get_key(obj));
+    return insert_noresize_with_hash(settings.munge_hash(key_hash), obj);
+  }
+
   template <typename K, typename... Args>
   std::pair<iterator, bool> emplace(K&& key, Args&&... args) {
     resize_delta(1);
@@ -1064,6 +1259,110 @@ class sparse_hashtable {
            typename std::iterator_traits<InputIterator>::iterator_category());
   }
 
+  // BATCHED INSERTION
+  // insert_batch(f, l, merge) inserts [f, l) like insert(f, l), but a
+  // block of BATCH_SIZE values at a time: it hashes the keys of a block
+  // and prefetches the groups of their home buckets before probing for any of them,
+  // so the cache misses overlap instead of coming one after another.
+  // For a value whose key is already there, in the table or earlier in
+  // the batch, it calls merge(existing, value) instead.  Returns how
+  // many values it inserted.
+  static const size_type BATCH_SIZE = 16;
+
+  template <class ForwardIterator, class Merge>
+  size_type insert_batch(ForwardIterator f, ForwardIterator l, Merge merge) {
+    static_assert(std::is_base_of<std::forward_iterator_tag,
+                      typename std::iterator_traits<ForwardIterator>::iterator_category>::value,
+                  "insert_batch() needs a forward iterator range");
+    size_t dist = std::distance(f, l);
+    if (dist >= (std::numeric_limits<size_type>::max)()) {
+      throw std::length_error("insert-range overflow");
+    }
+    resize_delta(static_cast<size_type>(dist));  // so nothing moves below
+    size_type key_hashes[BATCH_SIZE];
+    size_type num_inserted = 0;
+    while (f != l) {
+      ForwardIterator block = f;
+      size_type n = 0;
+      for (; n < BATCH_SIZE && f != l; ++n, ++f) {
+        key_hashes[n] = hash(get_key(*f));
+        const size_type bucknum = first_bucket(key_hashes[n]);
+        table.prefetch(bucknum);
+      }
+      for (size_type i = 0; i < n; ++i, ++block) {
+        std::pair<iterator, bool> res =
+            insert_noresize_with_hash(key_hashes[i], *block);
+        if (res.second)
+          ++num_inserted;
+        else
+          merge(*res.first, *block);
+      }
+    }
+    return num_inserted;
+  }
+
+  template <class ForwardIterator>
+  size_type insert_batch(ForwardIterator f, ForwardIterator l) {
+    return insert_batch(f, l, keep_existing());
+  }
+
+  // PARALLEL CONSTRUCTION
+  // parallel_insert(f, l, merge, exec) does what insert_batch(f, l,
+  // merge) does, for a random-access range.  It grows the table once,
+  // hashes the values on the threads of exec (as for the parallel sweeps
+  // below) and sorts them by home bucket into ranges of PARALLEL_CHUNK
+  // groups.  Inserting into a group changes counts the whole table
+  // shares, so the inserts themselves run on this thread, but a range at
+  // a time, so the groups being filled stay in cache.  It needs two
+  // size_types of scratch per value.
+  template <class RandomIterator, class Merge, class Executor>
+  size_type parallel_insert(RandomIterator f, RandomIterator l, Merge merge,
+                            Executor exec) {
+    static_assert(std::is_base_of<std::random_access_iterator_tag,
+                      typename std::iterator_traits<RandomIterator>::iterator_category>::value,
+                  "parallel_insert() needs a random-access range");
+    const size_t dist = l - f;
+    if (dist >= (std::numeric_limits<size_type>::max)()) {
+      throw std::length_error("insert-range overflow");
+    }
+    resize_delta(static_cast<size_type>(dist));  // so nothing moves below
+    auto&& run = sparsehash_internal::as_executor(exec);
+
+    const size_type range_buckets = PARALLEL_CHUNK * DEFAULT_GROUP_SIZE;
+    const size_type num_ranges = (bucket_count() + range_buckets - 1) / range_buckets;
+    std::vector<size_t> hashes, order, range_start;
+    sparsehash_internal::sort_by_range(
+        run, dist, num_ranges,
+        [&](size_t i) { return size_t(hash(get_key(f[i]))); },
+        [&](size_t h) { return first_bucket(h) / range_buckets; },
+        &hashes, &order, &range_start);
+
+    size_type num_inserted = 0;
+    for (size_t k = 0; k < dist; ++k) {
+      const size_t i = order[k];
+      std::pair<iterator, bool> res = insert_noresize_with_hash(hashes[i], f[i]);
+      if (res.second)
+        ++num_inserted;
+      else
+        merge(*res.first, f[i]);
+    }
+    return num_inserted;
+  }
+
+  template <class RandomIterator, class Executor>
+  size_type parallel_insert(RandomIterator f, RandomIterator l, Executor exec) {
+    return parallel_insert(f, l, keep_existing(), exec);
+  }
+
+ private:
+  // The merge for insert_batch(f, l): duplicates are dropped, as insert()
+  // drops them.
+  struct keep_existing {
+    template <class V>
+    void operator()(value_type&, const V&) const {}
+  };
+
+ public:
   // DefaultValue is a functor that takes a key and returns a value_type
   // representing the default value to be inserted if none is found.
   template <class DefaultValue>
@@ -1071,7 +1370,8 @@ class sparse_hashtable {
     // First, double-check we're not inserting delkey
     assert((!settings.use_deleted() || !equals(key, key_info.delkey)) &&
            "Inserting the deleted key");
-    const std::pair<size_type, size_type> pos = find_position(key);
+    size_type num_probes;
+    const std::pair<size_type, size_type> pos = find_position(key, &num_probes);
     DefaultValue default_value;
     if (pos.first != ILLEGAL_BUCKET) {  // object was already there
       return *table.get_iter(pos.first);
@@ -1080,17 +1380,99 @@ class sparse_hashtable {
       // insert.
       return *insert_noresize(default_value(key)).first;
     } else {  // no need to rehash, insert right here
+      settings.note_insert_probes(num_probes, table.num_nonempty(),
+                                  bucket_count());
       return *insert_at(default_value(key), pos.second);
     }
   }
 
+  // LOOKUP HANDLES
+  // prepare(key) probes for key once and remembers where the probe
+  // ended: the bucket holding key, or the bucket an insert of key would
+  // use.  The caller can then read or assign the value, or emplace a
+  // new one, through the handle without probing again.  A handle points
+  // at key, and is good until the next change to the table.
+  template <typename K>
+  class lookup_handle {
+   public:
+    bool found() const { return found_ != ILLEGAL_BUCKET; }
+
+    // The element with key.  Only call this if found().
+    iterator position() const {
+      assert(found() && "Handle's key is not in the table");
+      return iterator(ht_, ht_->table.get_iter(found_),
+                      ht_->table.nonempty_end());
+    }
+
+    // Inserts the value constructed from args, whose key must be the
+    // handle's key.  Only call this if !found(); afterwards found().
+    template <typename... Args>
+    iterator emplace(Args&&... args) {
+      return ht_->emplace_prepared(*this, std::forward<Args>(args)...);
+    }
+
+   private:
+    friend class sparse_hashtable;
+    lookup_handle(sparse_hashtable* ht, const K& key)
+        : ht_(ht), key_(&key), found_(ILLEGAL_BUCKET),
+          insert_pos_(ILLEGAL_BUCKET), num_probes_(0) {}
+
+    sparse_hashtable* ht_;
+    const K* key_;
+    size_type found_;       // bucket holding key, or ILLEGAL_BUCKET
+    size_type insert_pos_;  // where key would go, or ILLEGAL_BUCKET
+    size_type num_probes_;
+  };
+
+  template <typename K>
+  lookup_handle<K> prepare(const K& key) {
+    // First, double-check we're not looking for delkey
+    assert((!settings.use_deleted() || !equals(key, key_info.delkey)) &&
+           "Preparing the deleted key");
+    lookup_handle<K> handle(this, key);
+    const std::pair<size_type, size_type> pos =
+        find_position(key, &handle.num_probes_);
+    handle.found_ = pos.first;
+    handle.insert_pos_ = pos.second;
+    return handle;
+  }
+
+ private:
+  template <typename K, typename... Args>
+  iterator emplace_prepared(lookup_handle<K>& handle, Args&&... args) {
+    assert(!handle.found() && "Handle's key is already in the table");
+    if (resize_delta(1)) {  // needed to rehash to make room
+      // Since we resized, we can't use the handle's bucket, so look again.
+      handle.insert_pos_ =
+          find_position(*handle.key_, &handle.num_probes_).second;
+    }
+    settings.note_insert_probes(handle.num_probes_, table.num_nonempty(),
+                                bucket_count());
+    iterator it = emplace_at(handle.insert_pos_, std::forward<Args>(args)...);
+    handle.found_ = handle.insert_pos_;
+    handle.insert_pos_ = ILLEGAL_BUCKET;
+    return it;
+  }
+
+ public:
   // DELETION ROUTINES
-  size_type erase(const key_type& key) {
+  // K is key_type, or any type the key_equal can compare with it; the
+  // enable_if keeps erase(iterator) from picking this up.
+  template <typename K>
+  typename std::enable_if<!std::is_convertible<const K&, const_iterator>::value,
+                          size_type>::type
+  erase(const K& key) {
+    return erase(key, hash_function_value(key));
+  }
+
+  // key_hash is the precomputed hash_function_value(key).
+  template <typename K>
+  size_type erase(const K& key, size_t key_hash) {
     // First, double-check we're not erasing delkey.
     assert((!settings.use_deleted() || !equals(key, key_info.delkey)) &&
            "Erasing the deleted key");
     assert(!settings.use_deleted() || !equals(key, key_info.delkey));
-    const_iterator pos = find(key);  // shrug: shouldn't need to be const
+    const_iterator pos = find(key, key_hash);  // shrug: shouldn't need to be const
     if (pos != end()) {
       assert(!test_deleted(pos));  // or find() shouldn't have returned it
       set_deleted(pos);
@@ -1144,6 +1526,118 @@ class sparse_hashtable {
     settings.set_consider_shrink(true);
   }
 
+  // PARALLEL SWEEPS
+  // These split the table's groups into ranges of PARALLEL_CHUNK groups
+  // and run them on exec, which is an executor (see thread_executor.h)
+  // or the number of threads for a thread_executor, 0 meaning one per
+  // hardware thread.  Nothing else may use the table while a sweep runs.
+  static const size_type PARALLEL_CHUNK = 1024;
+
+  // Calls f(value) for every element.
+  template <class F, class Executor>
+  void parallel_for_each(F f, Executor exec) {
+    for_each_range(exec, [&](size_type, size_type first, size_type last) {
+      const iterator range_end(this, table.nonempty_end(first, last),
+                               table.nonempty_end(first, last));
+      for (iterator it(this, table.nonempty_begin(first, last),
+                       table.nonempty_end(first, last));
+           it != range_end; ++it)
+        f(*it);
+    });
+  }
+  template <class F, class Executor>
+  void parallel_for_each(F f, Executor exec) const {
+    for_each_range(exec, [&](size_type, size_type first, size_type last) {
+      const const_iterator range_end(this, table.nonempty_end(first, last),
+                                     table.nonempty_end(first, last));
+      for (const_iterator it(this, table.nonempty_begin(first, last),
+                             table.nonempty_end(first, last));
+           it != range_end; ++it)
+        f(*it);
+    });
+  }
+
+  // Erases every element for which pred(value) is true, and returns how
+  // many that was.  Each range counts its own erasures; they are added
+  // to num_deleted once all ranges are done, even if pred throws.
+  template <class Pred, class Executor>
+  size_type parallel_erase_if(Pred pred, Executor exec) {
+    check_use_deleted("parallel_erase_if()");
+    std::vector<size_type> erased(num_parallel_ranges(), 0);
+    try {
+      for_each_range(exec, [&](size_type r, size_type first, size_type last) {
+        const iterator range_end(this, table.nonempty_end(first, last),
+                                 table.nonempty_end(first, last));
+        size_type n = 0;
+        try {
+          for (iterator it(this, table.nonempty_begin(first, last),
+                           table.nonempty_end(first, last));
+               it != range_end; ++it) {
+            if (pred(*it) && set_deleted(it)) ++n;
+          }
+        } catch (...) {
+          erased[r] = n;
+          throw;
+        }
+        erased[r] = n;
+      });
+    } catch (...) {
+      note_parallel_erased(erased);
+      throw;
+    }
+    return note_parallel_erased(erased);
+  }
+
+  // Folds the elements of each range into a copy of identity with
+  // accumulate(partial, value), then folds the partial results together,
+  // in range order, with combine(result, partial).
+  template <class Result, class Accumulate, class Combine, class Executor>
+  Result parallel_reduce(Result identity, Accumulate accumulate,
+                         Combine combine, Executor exec) const {
+    std::vector<Result> partials(num_parallel_ranges(), identity);
+    for_each_range(exec, [&](size_type r, size_type first, size_type last) {
+      const const_iterator range_end(this, table.nonempty_end(first, last),
+                                     table.nonempty_end(first, last));
+      for (const_iterator it(this, table.nonempty_begin(first, last),
+                             table.nonempty_end(first, last));
+           it != range_end; ++it)
+        accumulate(partials[r], *it);
+    });
+    Result result = identity;
+    for (size_type r = 0; r < partials.size(); ++r) combine(result, partials[r]);
+    return result;
+  }
+
+ private:
+  size_type num_parallel_ranges() const {
+    if (size() == 0) return 0;
+    return (table.num_groups() + PARALLEL_CHUNK - 1) / PARALLEL_CHUNK;
+  }
+
+  // Calls fn(range, first_group, last_group) for every range, on exec.
+  template <class Executor, class RangeFn>
+  void for_each_range(Executor& exec, RangeFn fn) const {
+    const size_type num_ranges = num_parallel_ranges();
+    if (num_ranges == 0) return;
+    auto&& run = sparsehash_internal::as_executor(exec);
+    run(num_ranges, [&](size_t r) {
+      const size_type first = r * PARALLEL_CHUNK;
+      fn(r, first, (std::min)(table.num_groups(), first + PARALLEL_CHUNK));
+    });
+  }
+
+  size_type note_parallel_erased(const std::vector<size_type>& erased) {
+    size_type total = 0;
+    for (size_type r = 0; r < erased.size(); ++r) total += erased[r];
+    if (total > 0) {
+      num_deleted += total;
+      // will think about shrink after next insert
+      settings.set_consider_shrink(true);
+    }
+    return total;
+  }
+
+ public:
   // COMPARISON
   bool operator==(const sparse_hashtable& ht) const {
     if (size() != ht.size()) {
@@ -1182,10 +1676,17 @@ class sparse_hashtable {
     return table.write_metadata(fp);
   }
 
+  // The values come later, in read_nopointer_data(), so we can't
+  // rehash a file written in the old hash order; use unserialize().
   template <typename INPUT>
   bool read_metadata(INPUT* fp) {
     num_deleted = 0;  // since we got rid before writing
-    const bool result = table.read_metadata(fp);
+    bool old_hash_order = false;
+    bool result = table.read_metadata(fp, &old_hash_order);
+    if (result && old_hash_order) {
+      table.clear();
+      result = false;
+    }
     settings.reset_thresholds(bucket_count());
     return result;
   }
@@ -1221,7 +1722,27 @@ class sparse_hashtable {
   template <typename ValueSerializer, typename INPUT>
   bool unserialize(ValueSerializer serializer, INPUT* fp) {
     num_deleted = 0;  // since we got rid before writing
-    const bool result = table.unserialize(serializer, fp);
+    bool old_hash_order = false;
+    const bool result = table.unserialize(serializer, fp, &old_hash_order);
+    settings.reset_thresholds(bucket_count());
+    if (result && old_hash_order)
+      rehash_to(MoveDontCopy, bucket_count(), resize_event::REHASH);
+    return result;
+  }
+
+  // The chunked format, written and read on several threads; see
+  // sparsetable::parallel_serialize().
+  template <typename ValueSerializer, typename Executor>
+  bool parallel_serialize(ValueSerializer serializer, int fd, Executor exec) {
+    squash_deleted();  // so we don't have to worry about delkey
+    return table.parallel_serialize(serializer, fd, exec);
+  }
+
+  template <typename ValueSerializer, typename Executor>
+  bool parallel_unserialize(ValueSerializer serializer, int fd,
+                            Executor exec) {
+    num_deleted = 0;  // since we got rid before writing
+    const bool result = table.parallel_unserialize(serializer, fd, exec);
     settings.reset_thresholds(bucket_count());
     return result;
   }
@@ -1271,6 +1792,19 @@ class sparse_hashtable {
   // Utility functions to access the templated operators
   template <typename K>
   size_type hash(const K& v) const { return settings.hash(v); }
+
+  // Where the probe sequence for a hash value starts, and where it goes
+  // after num_probes probes.  Quadratic probing only reaches every
+  // bucket when the bucket count is a power of two, so fine-grained
+  // tables probe linearly.
+  size_type first_bucket(size_type h) const {
+    return settings.bucket_for_hash(h, bucket_count());
+  }
+  size_type next_bucket(size_type bucknum, size_type num_probes) const {
+    if (settings.fine_grained_buckets())
+      return bucknum + 1 == bucket_count() ? 0 : bucknum + 1;
+    return (bucknum + JUMP_(key, num_probes)) & (bucket_count() - 1);
+  }
   template <typename K1, typename K2>
   bool equals(const K1& a, const K2& b) const {
     return key_info.equals(a, b);
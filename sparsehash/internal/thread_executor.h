@@ -0,0 +1,161 @@
+// Copyright (c) 2006, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// ---
+//
+// The parallel sweeps of the hashtables (parallel_for_each() and
+// friends) split the table into ranges and hand them to an executor:
+// anything that can be called as exec(num_tasks, task), and runs
+// task(0), ..., task(num_tasks - 1), in any order and on any threads,
+// before returning.  To run them on a thread pool of your own, pass
+// such a callable.  thread_executor is the default: it starts up to
+// num_threads std::threads for the call, and has them take tasks in
+// turn, so that a range that takes longer doesn't hold up the rest.
+//
+// This file also has the helpers the tables share for their parallel
+// operations.
+
+#pragma once
+
+#include <stddef.h>    // for size_t
+#include <atomic>
+#include <exception>   // for exception_ptr
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace google {
+
+class thread_executor {
+ public:
+  // 0 threads means one per hardware thread.
+  explicit thread_executor(unsigned num_threads = 0)
+      : num_threads_(num_threads != 0 ? num_threads
+                                      : std::thread::hardware_concurrency()) {
+    if (num_threads_ == 0) num_threads_ = 1;  // hardware_concurrency() unknown
+  }
+
+  unsigned num_threads() const { return num_threads_; }
+
+  // Runs the tasks on the calling thread and num_threads() - 1 others.
+  // If a task throws, the tasks not yet started are skipped, and the
+  // first exception is rethrown here once the others are done.
+  template <class Task>
+  void operator()(size_t num_tasks, Task task) const {
+    const size_t num_workers = num_tasks < num_threads_ ? num_tasks : num_threads_;
+    if (num_workers <= 1) {
+      for (size_t i = 0; i < num_tasks; ++i) task(i);
+      return;
+    }
+    std::atomic<size_t> next_task(0);
+    std::exception_ptr error;
+    std::mutex error_mutex;  // guards error
+    auto work = [&]() {
+      for (size_t i = next_task.fetch_add(1); i < num_tasks;
+           i = next_task.fetch_add(1)) {
+        try {
+          task(i);
+        } catch (...) {
+          std::lock_guard<std::mutex> l(error_mutex);
+          if (!error) error = std::current_exception();
+          next_task.store(num_tasks);  // skip the rest
+        }
+      }
+    };
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < num_workers; ++i) threads.push_back(std::thread(work));
+    work();
+    for (size_t i = 0; i < threads.size(); ++i) threads[i].join();
+    if (error) std::rethrow_exception(error);
+  }
+
+ private:
+  unsigned num_threads_;
+};
+
+namespace sparsehash_internal {
+
+// The parallel sweeps take either an executor or a number of threads;
+// this turns the latter into a thread_executor.
+template <class Executor>
+typename std::enable_if<!std::is_integral<Executor>::value, Executor&>::type
+as_executor(Executor& exec) {
+  return exec;
+}
+inline thread_executor as_executor(unsigned num_threads) {
+  return thread_executor(num_threads);
+}
+
+// For parallel_insert(): sets hashes[i] to hash_of(i) for each i < n,
+// and sorts the indexes 0..n-1 into order by range_of(hashes[i]),
+// keeping them in increasing order within a range.  Range r takes up
+// order[range_start[r]] to order[range_start[r + 1] - 1].  Both passes
+// over the input run on run, in NUM_SORT_TASKS slices.
+static const size_t NUM_SORT_TASKS = 64;
+
+template <class Run, class HashOf, class RangeOf>
+void sort_by_range(Run& run, size_t n, size_t num_ranges, HashOf hash_of,
+                   RangeOf range_of, std::vector<size_t>* hashes,
+                   std::vector<size_t>* order,
+                   std::vector<size_t>* range_start) {
+  const size_t slice = n / NUM_SORT_TASKS + 1;
+  const size_t num_slices = (n + slice - 1) / slice;
+  hashes->resize(n);
+  order->resize(n);
+  // counts[s * num_ranges + r]: how many of slice s go to range r, and
+  // then where the first of them goes in order.
+  std::vector<size_t> counts(num_slices * num_ranges, 0);
+  run(num_slices, [&](size_t s) {
+    size_t* slice_counts = &counts[s * num_ranges];
+    for (size_t i = s * slice; i < n && i < (s + 1) * slice; ++i) {
+      (*hashes)[i] = hash_of(i);
+      ++slice_counts[range_of((*hashes)[i])];
+    }
+  });
+  range_start->assign(num_ranges + 1, 0);
+  size_t next = 0;
+  for (size_t r = 0; r < num_ranges; ++r) {
+    (*range_start)[r] = next;
+    for (size_t s = 0; s < num_slices; ++s) {
+      const size_t count = counts[s * num_ranges + r];
+      counts[s * num_ranges + r] = next;
+      next += count;
+    }
+  }
+  (*range_start)[num_ranges] = next;
+  run(num_slices, [&](size_t s) {
+    size_t* slice_next = &counts[s * num_ranges];
+    for (size_t i = s * slice; i < n && i < (s + 1) * slice; ++i)
+      (*order)[slice_next[range_of((*hashes)[i])]++] = i;
+  });
+}
+
+}  // namespace sparsehash_internal
+}  // namespace google
@@ -0,0 +1,83 @@
+#include <sparsehash/atomic_dense_hash_map>
+
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+using google::atomic_dense_hash_map;
+
+TEST(AtomicDenseHashMap, InsertAndUpdate)
+{
+    atomic_dense_hash_map<int, long> map(-1);
+    ASSERT_TRUE(map.empty());
+    ASSERT_EQ(NULL, map.find(1));
+
+    std::pair<std::atomic<long>*, bool> res = map.insert(1, 10);
+    ASSERT_TRUE(res.second);
+    ASSERT_EQ(10, res.first->load());
+    res = map.insert(1, 20);
+    ASSERT_FALSE(res.second);
+    ASSERT_EQ(10, res.first->load());
+
+    ASSERT_EQ(10, map.fetch_add(1, 5));
+    ASSERT_EQ(0, map.fetch_add(2, 7));  // new keys start at T()
+    long expected = 15;
+    ASSERT_TRUE(map[1].compare_exchange_strong(expected, 100));
+    ASSERT_EQ(100, map.find(1)->load());
+    ASSERT_EQ(7, map[2].load());
+    ASSERT_EQ(2u, map.size());
+    ASSERT_EQ(1u, map.count(2));
+    ASSERT_EQ(0u, map.count(3));
+}
+
+TEST(AtomicDenseHashMap, AtomicsSurviveGrowth)
+{
+    atomic_dense_hash_map<int, int> map(0);
+    std::atomic<int>* first = &map[1];
+    first->store(42);
+    const size_t buckets = map.bucket_count();
+    for (int i = 2; i < 1000; ++i) map.insert(i, i);
+    ASSERT_LT(buckets, map.bucket_count());
+    ASSERT_EQ(first, map.find(1));
+    ASSERT_EQ(42, map.find(1)->load());
+
+    int sum = 0;
+    size_t n = 0;
+    map.for_each([&](int key, const std::atomic<int>& value) {
+        if (key != 1) sum += value.load() - key;
+        ++n;
+    });
+    ASSERT_EQ(0, sum);
+    ASSERT_EQ(999u, n);
+}
+
+TEST(AtomicDenseHashMap, ConcurrentCounters)
+{
+    // Every thread bumps the same counters while also adding keys of its
+    // own, so the table grows under the updates.
+    const int kThreads = 8;
+    const int kRounds = 2000;
+    const uint64_t kCounters = 16;
+    atomic_dense_hash_map<uint64_t, uint64_t> map(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreads; ++t) {
+        threads.emplace_back([&map, t, kCounters]() {
+            for (int i = 0; i < kRounds; ++i) {
+                map.fetch_add(1 + i % kCounters, 1, std::memory_order_relaxed);
+                map.insert(1000 + t * kRounds + i, 1);
+            }
+        });
+    }
+    for (size_t i = 0; i < threads.size(); ++i) threads[i].join();
+
+    ASSERT_EQ(kCounters + kThreads * kRounds, map.size());
+    uint64_t total = 0;
+    for (uint64_t key = 1; key <= kCounters; ++key)
+        total += map.find(key)->load();
+    ASSERT_EQ(static_cast<uint64_t>(kThreads) * kRounds, total);
+    for (int i = 0; i < kThreads * kRounds; ++i)
+        ASSERT_EQ(1u, map.find(1000 + i)->load());
+}
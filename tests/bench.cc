@@ -80,19 +80,34 @@ extern "C" {
 #include <vector>
 #include <chrono>
 #include <type_traits>
+#include <mutex>
+#include <thread>
+#include <sparsehash/atomic_dense_hash_map>
+#include <sparsehash/concurrent_dense_hash_set>
 #include <sparsehash/dense_hash_map>
+#include <sparsehash/dense_hash_set>
+#include <sparsehash/dense_node_hash_map>
+#include <sparsehash/flat_combining_dense_hash_map>
 #include <sparsehash/sparse_hash_map>
+#include <sparsehash/write_combining_dense_hash_map>
+#include <sparsehash/packed>
+#include <sparsehash/hash>
+#include <string>
 
 using std::map;
 using std::unordered_map;
 using std::swap;
 using std::vector;
+using std::string;
 using std::chrono::steady_clock;
 using std::chrono::duration_cast;
 using std::chrono::time_point;
 using std::chrono::nanoseconds;
 using google::dense_hash_map;
+using google::dense_node_hash_map;
 using google::sparse_hash_map;
+using google::packed;
+using google::fast_hash;
 
 static bool FLAGS_test_sparse_hash_map = true;
 static bool FLAGS_test_dense_hash_map = true;
@@ -103,6 +118,17 @@ static bool FLAGS_test_4_bytes = true;
 static bool FLAGS_test_8_bytes = true;
 static bool FLAGS_test_16_bytes = true;
 static bool FLAGS_test_256_bytes = true;
+static bool FLAGS_test_packed = true;
+static bool FLAGS_test_hash_functions = true;
+static bool FLAGS_test_node_map = true;
+static bool FLAGS_test_insert_batch = true;
+static bool FLAGS_test_concurrent_set = true;
+static bool FLAGS_test_flat_combining = true;
+static bool FLAGS_test_write_combining = true;
+static bool FLAGS_test_atomic_values = true;
+static bool FLAGS_test_parallel_sweeps = true;
+static bool FLAGS_test_parallel_insert = true;
+static bool FLAGS_test_rehash_strategy = true;
 
 static const int kDefaultIters = 10000000;
 
@@ -636,6 +662,439 @@ static void test_all_maps(int obj_size, int iters) {
         "STANDARD MAP", obj_size, iters, false);
 }
 
+// Compares a dense_hash_map whose buckets are padded std::pairs with
+// one that uses a packed<> key, in bytes per entry and lookup time.
+template <class MapType>
+static void measure_bucket_layout(const char* label, int iters) {
+  MapType set;
+  set.set_empty_key(0);
+  vector<int> v(iters);
+  for (int i = 0; i < iters; i++) {
+    set[i + 1] = i;
+    v[i] = i;
+  }
+  shuffle(&v);
+
+  Rusage t;
+  int r = 1;
+  t.Reset();
+  for (int i = 0; i < iters; i++) {
+    r ^= static_cast<int>(set.find(v[i] + 1) != set.end());
+  }
+  double ut = t.UserTime();
+  srand(r);  // keep compiler from optimizing away r (we never call rand())
+
+  printf("%-44s %5.1f bytes/entry %6.1f ns/lookup\n", label,
+         static_cast<double>(set.bucket_count() *
+                             sizeof(typename MapType::value_type)) / iters,
+         ut / iters);
+  fflush(stdout);
+}
+
+static void test_packed_maps(int iters) {
+  printf("\nBUCKET LAYOUT (%d iterations):\n", iters);
+  measure_bucket_layout<dense_hash_map<uint64_t, uint32_t>>(
+      "dense_hash_map<uint64_t, uint32_t>", iters);
+  measure_bucket_layout<dense_hash_map<packed<uint64_t>, uint32_t>>(
+      "dense_hash_map<packed<uint64_t>, uint32_t>", iters);
+  measure_bucket_layout<dense_hash_map<uint32_t, uint8_t>>(
+      "dense_hash_map<uint32_t, uint8_t>", iters);
+  measure_bucket_layout<dense_hash_map<packed<uint32_t>, uint8_t>>(
+      "dense_hash_map<packed<uint32_t>, uint8_t>", iters);
+}
+
+// Inserts and then looks up every key, to compare hash functions on
+// keys that std::hash treats badly (integers that differ only in their
+// high bits) and on strings.
+template <class MapType, class Key>
+static void measure_hash_function(const char* label, const vector<Key>& keys) {
+  MapType set;
+  set.set_empty_key(Key());
+  Rusage t;
+  int r = 1;
+  t.Reset();
+  for (size_t i = 0; i < keys.size(); i++) {
+    set[keys[i]] = static_cast<int>(i);
+  }
+  for (size_t i = 0; i < keys.size(); i++) {
+    r ^= static_cast<int>(set.find(keys[i]) != set.end());
+  }
+  double ut = t.UserTime();
+  srand(r);  // keep compiler from optimizing away r (we never call rand())
+
+  printf("%-44s %6.1f ns/key\n", label, ut / keys.size());
+  fflush(stdout);
+}
+
+// The identity hash, marked so the hashtables don't finalize it; this
+// is how std::hash<uintptr_t> was treated before they did.
+struct UnfinalizedHash {
+  typedef void is_avalanching;
+  size_t operator()(uintptr_t v) const { return v; }
+};
+
+static void test_hash_functions(int iters) {
+  // std::hash is the identity on integers, so strided keys all collide
+  // in the low bits; keep the count small enough to finish.
+  const int num_ints = iters / 100;
+  printf("\nHASH FUNCTIONS (%d integer keys, %d string keys):\n", num_ints,
+         iters / 10);
+  vector<uint64_t> ints(num_ints);
+  for (int i = 0; i < num_ints; i++) {
+    ints[i] = (static_cast<uint64_t>(i) + 1) << 10;
+  }
+  measure_hash_function<dense_hash_map<uint64_t, int>>(
+      "std::hash<uint64_t>, keys i << 10", ints);
+  measure_hash_function<dense_hash_map<uint64_t, int, fast_hash<uint64_t>>>(
+      "fast_hash<uint64_t>, keys i << 10", ints);
+
+  vector<string> strings(iters / 10);
+  char buf[64];
+  for (size_t i = 0; i < strings.size(); i++) {
+    snprintf(buf, sizeof(buf), "/some/longer/path/to/file-%zu.txt", i);
+    strings[i] = buf;
+  }
+  measure_hash_function<dense_hash_map<string, int>>("std::hash<string>",
+                                                     strings);
+  measure_hash_function<dense_hash_map<string, int, fast_hash<string>>>(
+      "fast_hash<string>", strings);
+
+  printf("\nstd::hash<uintptr_t>, finalized by the table:\n");
+  stresshashfunction<EasyUseDenseHashMap<uintptr_t, int, std::hash<uintptr_t>>>(
+      iters / 4);
+  printf("identity hash, not finalized:\n");
+  stresshashfunction<EasyUseDenseHashMap<uintptr_t, int, UnfinalizedHash>>(
+      iters / 4);
+}
+
+// Grows a map of 1 KB values from empty, which dense_hash_map does by
+// moving every value on each resize and dense_node_hash_map by moving
+// pointers.
+struct KilobyteValue {
+  char bytes[1024];
+};
+
+template <class MapType>
+static void time_kilobyte_grow(const char* label, int iters) {
+  MapType set;
+  Rusage t;
+  t.Reset();
+  for (int i = 0; i < iters; i++) {
+    set[i + 1].bytes[0] = static_cast<char>(i);
+  }
+  double ut = t.UserTime();
+  printf("%-44s %6.1f ns/insert\n", label, ut / iters);
+  fflush(stdout);
+}
+
+static void test_node_map(int iters) {
+  printf("\nNODE-STABLE MAP (%d 1 KB values):\n", iters);
+  time_kilobyte_grow<dense_hash_map<int, KilobyteValue>>(
+      "dense_hash_map<int, 1 KB>", iters);
+  time_kilobyte_grow<dense_node_hash_map<int, KilobyteValue>>(
+      "dense_node_hash_map<int, 1 KB>", iters);
+}
+
+template <class MapType>
+static void time_insert_range(const char* label,
+                              const vector<std::pair<int, int>>& values,
+                              bool batched) {
+  MapType map;
+  Rusage t;
+  t.Reset();
+  if (batched)
+    map.insert_batch(values.begin(), values.end());
+  else
+    map.insert(values.begin(), values.end());
+  double ut = t.UserTime();
+  printf("%-44s %6.1f ns/insert\n", label, ut / values.size());
+  fflush(stdout);
+}
+
+static void test_insert_batch(int iters) {
+  printf("\nBATCHED INSERT (%d random keys):\n", iters);
+  vector<int> keys(iters);
+  for (int i = 0; i < iters; i++) keys[i] = i;
+  shuffle(&keys);
+  vector<std::pair<int, int>> values;
+  values.reserve(iters);
+  for (int i = 0; i < iters; i++) values.push_back(std::make_pair(keys[i], i));
+
+  time_insert_range<dense_hash_map<int, int>>(
+      "dense_hash_map insert(f, l)", values, false);
+  time_insert_range<dense_hash_map<int, int>>(
+      "dense_hash_map insert_batch(f, l)", values, true);
+  time_insert_range<sparse_hash_map<int, int>>(
+      "sparse_hash_map insert(f, l)", values, false);
+  time_insert_range<sparse_hash_map<int, int>>(
+      "sparse_hash_map insert_batch(f, l)", values, true);
+}
+
+// Runs insert(key) for iters keys, half of them repeats, split over
+// num_threads threads.
+template <class InsertFn>
+static double time_threaded_inserts(int iters, int num_threads,
+                                    InsertFn insert) {
+  vector<std::thread> threads;
+  Rusage t;
+  for (int n = 0; n < num_threads; n++) {
+    threads.push_back(std::thread([=]() {
+      for (int i = n; i < iters; i += num_threads)
+        insert(google::hash_mix64(static_cast<uint64_t>(i / 2)) | 1);
+    }));
+  }
+  for (size_t n = 0; n < threads.size(); n++) threads[n].join();
+  return t.UserTime();
+}
+
+static void test_concurrent_set(int iters) {
+  const int max_threads = std::max(1u, std::min(8u, std::thread::hardware_concurrency()));
+  printf("\nCONCURRENT DEDUPLICATION (%d inserts, half repeats):\n", iters);
+  for (int num_threads = 1; num_threads <= max_threads; num_threads *= 2) {
+    google::dense_hash_set<uint64_t> locked;
+    locked.set_empty_key(0);
+    std::mutex mu;
+    const double locked_ns = time_threaded_inserts(iters, num_threads,
+        [&](uint64_t key) {
+          std::lock_guard<std::mutex> l(mu);
+          locked.insert(key);
+        });
+    google::concurrent_dense_hash_set<uint64_t> concurrent(0, ~uint64_t(0));
+    const double concurrent_ns = time_threaded_inserts(iters, num_threads,
+        [&](uint64_t key) { concurrent.insert(key); });
+    printf("%2d threads: dense_hash_set+mutex %6.1f ns/insert, "
+           "concurrent_dense_hash_set %6.1f ns/insert\n",
+           num_threads, locked_ns / iters, concurrent_ns / iters);
+    fflush(stdout);
+  }
+}
+
+// A dense_hash_map split into shards by hash, each behind its own mutex.
+class sharded_dense_hash_map {
+ public:
+  static const int NUM_SHARDS = 16;
+
+  sharded_dense_hash_map() {
+    for (int i = 0; i < NUM_SHARDS; i++) shards_[i].map.set_empty_key(0);
+  }
+  void insert_or_assign(uint64_t key, uint64_t value) {
+    shard& s = shards_[google::hash_mix64(key) % NUM_SHARDS];
+    std::lock_guard<std::mutex> l(s.mu);
+    s.map[key] = value;
+  }
+
+ private:
+  struct shard {
+    std::mutex mu;
+    google::dense_hash_map<uint64_t, uint64_t> map;
+  };
+  shard shards_[NUM_SHARDS];
+};
+
+static void test_flat_combining(int iters) {
+  const int max_threads = std::max(1u, std::min(8u, std::thread::hardware_concurrency()));
+  printf("\nCONTENDED WRITES (%d insert_or_assign, half repeats):\n", iters);
+  for (int num_threads = 1; num_threads <= max_threads; num_threads *= 2) {
+    google::dense_hash_map<uint64_t, uint64_t> locked;
+    locked.set_empty_key(0);
+    std::mutex mu;
+    const double locked_ns = time_threaded_inserts(iters, num_threads,
+        [&](uint64_t key) {
+          std::lock_guard<std::mutex> l(mu);
+          locked[key] = key;
+        });
+    sharded_dense_hash_map sharded;
+    const double sharded_ns = time_threaded_inserts(iters, num_threads,
+        [&](uint64_t key) { sharded.insert_or_assign(key, key); });
+    google::dense_hash_map<uint64_t, uint64_t> initial;
+    initial.set_empty_key(0);
+    google::flat_combining_dense_hash_map<uint64_t, uint64_t> combining(initial);
+    const double combining_ns = time_threaded_inserts(iters, num_threads,
+        [&](uint64_t key) { combining.insert_or_assign(key, key); });
+    printf("%2d threads: mutex %6.1f ns/op, %d shards %6.1f ns/op, "
+           "flat combining %6.1f ns/op\n",
+           num_threads, locked_ns / iters, sharded_dense_hash_map::NUM_SHARDS,
+           sharded_ns / iters, combining_ns / iters);
+    fflush(stdout);
+  }
+}
+
+static void test_write_combining(int iters) {
+  const int max_threads = std::max(1u, std::min(8u, std::thread::hardware_concurrency()));
+  const int num_keys = 512;
+  printf("\nCONTENDED COUNTING (%d increments over %d keys):\n", iters,
+         num_keys);
+  for (int num_threads = 1; num_threads <= max_threads; num_threads *= 2) {
+    google::dense_hash_map<uint64_t, long> locked;
+    locked.set_empty_key(0);
+    std::mutex mu;
+    vector<std::thread> threads;
+    Rusage t;
+    for (int n = 0; n < num_threads; n++) {
+      threads.push_back(std::thread([&, n]() {
+        for (int i = n; i < iters; i += num_threads) {
+          std::lock_guard<std::mutex> l(mu);
+          locked[i % num_keys + 1] += 1;
+        }
+      }));
+    }
+    for (size_t n = 0; n < threads.size(); n++) threads[n].join();
+    const double locked_ns = t.UserTime();
+
+    typedef google::write_combining_dense_hash_map<uint64_t, long> Counts;
+    google::dense_hash_map<uint64_t, long> initial;
+    initial.set_empty_key(0);
+    Counts combining(initial);
+    threads.clear();
+    t.Reset();
+    for (int n = 0; n < num_threads; n++) {
+      threads.push_back(std::thread([&, n]() {
+        Counts::buffer buf(&combining);
+        for (int i = n; i < iters; i += num_threads)
+          buf.add(i % num_keys + 1, 1);
+      }));
+    }
+    for (size_t n = 0; n < threads.size(); n++) threads[n].join();
+    const double combining_ns = t.UserTime();
+
+    printf("%2d threads: dense_hash_map+mutex %6.1f ns/increment, "
+           "thread buffers %6.1f ns/increment\n",
+           num_threads, locked_ns / iters, combining_ns / iters);
+    fflush(stdout);
+  }
+}
+
+static void test_atomic_values(int iters) {
+  const int max_threads = std::max(1u, std::min(8u, std::thread::hardware_concurrency()));
+  const uint64_t num_keys = 1024;
+  printf("\nCOUNTER UPDATES (%d increments over %d existing keys):\n", iters,
+         static_cast<int>(num_keys));
+  for (int num_threads = 1; num_threads <= max_threads; num_threads *= 2) {
+    google::dense_hash_map<uint64_t, uint64_t> locked;
+    locked.set_empty_key(0);
+    google::atomic_dense_hash_map<uint64_t, uint64_t> atomic(0, num_keys);
+    for (uint64_t k = 1; k <= num_keys; k++) {
+      locked[k] = 0;
+      atomic.insert(k, 0);
+    }
+    std::mutex mu;
+    const double locked_ns = time_threaded_inserts(iters, num_threads,
+        [&](uint64_t key) {
+          std::lock_guard<std::mutex> l(mu);
+          locked[key % num_keys + 1] += 1;
+        });
+    const double atomic_ns = time_threaded_inserts(iters, num_threads,
+        [&](uint64_t key) {
+          atomic.find(key % num_keys + 1)->fetch_add(1, std::memory_order_relaxed);
+        });
+    printf("%2d threads: dense_hash_map+mutex %6.1f ns/increment, "
+           "atomic_dense_hash_map %6.1f ns/increment\n",
+           num_threads, locked_ns / iters, atomic_ns / iters);
+    fflush(stdout);
+  }
+}
+
+// Wall-clock time, since the point is to use more cores.
+template <class F>
+static double wall_ns(F f) {
+  const time_point<steady_clock> start = steady_clock::now();
+  f();
+  return static_cast<double>(
+      duration_cast<nanoseconds>(steady_clock::now() - start).count());
+}
+
+static void test_parallel_sweeps(int iters) {
+  google::dense_hash_map<uint64_t, uint64_t> map;
+  map.set_empty_key(0);
+  for (int i = 1; i <= iters; i++) map[i] = i;
+  const unsigned num_threads = std::max(1u, std::thread::hardware_concurrency());
+  printf("\nPARALLEL SWEEPS (%d elements, %u threads):\n", iters, num_threads);
+
+  uint64_t serial_sum = 0;
+  const double serial_ns = wall_ns([&]() {
+    for (google::dense_hash_map<uint64_t, uint64_t>::const_iterator it =
+             map.begin(); it != map.end(); ++it)
+      serial_sum += it->second;
+  });
+  uint64_t parallel_sum = 0;
+  const double parallel_ns = wall_ns([&]() {
+    parallel_sum = map.parallel_reduce(
+        uint64_t(0),
+        [](uint64_t& sum, const std::pair<const uint64_t, uint64_t>& v) {
+          sum += v.second;
+        },
+        [](uint64_t& sum, const uint64_t& partial) { sum += partial; },
+        num_threads);
+  });
+  assert(serial_sum == parallel_sum);
+  (void)parallel_sum;
+  printf("sum: iterator %6.1f ns/element, parallel_reduce %6.1f ns/element\n",
+         serial_ns / iters, parallel_ns / iters);
+
+  const double erase_ns = wall_ns([&]() {
+    map.parallel_erase_if(
+        [](const std::pair<const uint64_t, uint64_t>& v) { return v.first % 2; },
+        num_threads);
+  });
+  printf("parallel_erase_if (half): %6.1f ns/element\n", erase_ns / iters);
+  fflush(stdout);
+}
+
+static void test_parallel_insert(int iters) {
+  vector<std::pair<uint64_t, uint64_t>> values;
+  for (int i = 0; i < iters; i++)
+    values.push_back(std::make_pair(google::hash_mix64(i) | 1, i));
+  const unsigned num_threads = std::max(1u, std::thread::hardware_concurrency());
+  printf("\nBULK CONSTRUCTION (%d values, %u threads):\n", iters, num_threads);
+
+  google::dense_hash_map<uint64_t, uint64_t> serial;
+  serial.set_empty_key(0);
+  const double serial_ns = wall_ns([&]() {
+    serial.insert_batch(values.begin(), values.end());
+  });
+  google::dense_hash_map<uint64_t, uint64_t> parallel;
+  parallel.set_empty_key(0);
+  const double parallel_ns = wall_ns([&]() {
+    parallel.parallel_insert(values.begin(), values.end(), num_threads);
+  });
+  printf("dense_hash_map: insert_batch %6.1f ns/value, "
+         "parallel_insert %6.1f ns/value\n",
+         serial_ns / iters, parallel_ns / iters);
+  fflush(stdout);
+}
+
+// How long one rehash into twice the buckets takes, for tables small
+// enough and big enough to spill out of the cache.
+static void test_rehash_strategy(int iters) {
+  static const struct {
+    google::resize_policy::rehash_strategy_type strategy;
+    const char* name;
+  } strategies[] = {
+      {google::resize_policy::REHASH_DIRECT, "direct"},
+      {google::resize_policy::REHASH_PREFETCH, "prefetch"},
+      {google::resize_policy::REHASH_PARTITIONED, "partitioned"},
+  };
+  printf("\nREHASH STRATEGY (ns/element for one doubling):\n");
+  for (int n = iters / 100; n <= iters; n *= 10) {
+    if (n == 0) continue;
+    printf("%10d elements:", n);
+    for (const auto& s : strategies) {
+      google::dense_hash_map<uint64_t, uint64_t> map;
+      map.set_empty_key(0);
+      google::resize_policy policy;
+      policy.rehash_strategy = s.strategy;
+      map.set_resize_policy(policy);
+      for (int i = 1; i <= n; i++) map[google::hash_mix64(i) | 1] = i;
+      const size_t buckets = map.bucket_count();
+      const double ns = wall_ns([&]() { map.resize(buckets); });
+      assert(map.bucket_count() > buckets);
+      printf("  %s %6.1f", s.name, ns / n);
+    }
+    printf("\n");
+    fflush(stdout);
+  }
+}
+
 int main(int argc, char** argv) {
   int iters = kDefaultIters;
   if (argc > 1) {  // first arg is # of iterations
@@ -660,6 +1119,17 @@ int main(int argc, char** argv) {
   if (FLAGS_test_16_bytes) test_all_maps<HashObject<16, 16>>(16, iters / 4);
   if (FLAGS_test_256_bytes)
     test_all_maps<HashObject<256, 32>>(256, iters / 32);
+  if (FLAGS_test_packed) test_packed_maps(iters);
+  if (FLAGS_test_hash_functions) test_hash_functions(iters);
+  if (FLAGS_test_node_map) test_node_map(iters / 100);
+  if (FLAGS_test_insert_batch) test_insert_batch(iters);
+  if (FLAGS_test_concurrent_set) test_concurrent_set(iters);
+  if (FLAGS_test_flat_combining) test_flat_combining(iters);
+  if (FLAGS_test_write_combining) test_write_combining(iters);
+  if (FLAGS_test_atomic_values) test_atomic_values(iters);
+  if (FLAGS_test_parallel_sweeps) test_parallel_sweeps(iters);
+  if (FLAGS_test_parallel_insert) test_parallel_insert(iters);
+  if (FLAGS_test_rehash_strategy) test_rehash_strategy(iters);
 
   return 0;
 }
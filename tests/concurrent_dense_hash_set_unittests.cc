@@ -0,0 +1,73 @@
+#include <sparsehash/concurrent_dense_hash_set>
+#include <sparsehash/hash>
+
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+using google::concurrent_dense_hash_set;
+
+TEST(ConcurrentDenseHashSet, InsertAndContains)
+{
+    concurrent_dense_hash_set<uint64_t> set(0, ~uint64_t(0));
+    ASSERT_TRUE(set.empty());
+    const size_t start_buckets = set.bucket_count();
+    for (uint64_t i = 1; i <= 10000; ++i)
+        ASSERT_TRUE(set.insert(i * 7));
+    for (uint64_t i = 1; i <= 10000; ++i)
+        ASSERT_FALSE(set.insert(i * 7));
+    ASSERT_EQ(10000u, set.size());
+    ASSERT_GT(set.bucket_count(), start_buckets);
+    for (uint64_t i = 1; i <= 70000; ++i)
+        ASSERT_EQ(i % 7 == 0, set.contains(i)) << i;
+
+    uint64_t sum = 0;
+    size_t n = 0;
+    set.for_each([&](uint64_t k) { sum += k; ++n; });
+    ASSERT_EQ(10000u, n);
+    ASSERT_EQ(7u * 10000u * 10001u / 2, sum);
+}
+
+TEST(ConcurrentDenseHashSet, ExpectedMaxItems)
+{
+    concurrent_dense_hash_set<uint64_t> set(0, 1, 5000);
+    const size_t buckets = set.bucket_count();
+    for (uint64_t i = 2; i < 5002; ++i)
+        set.insert(i);
+    ASSERT_EQ(buckets, set.bucket_count());
+}
+
+TEST(ConcurrentDenseHashSet, ThreadsDeduplicate)
+{
+    // Every thread inserts the same keys, in a different order, while
+    // the set grows from its smallest size.  Each key must be reported
+    // new exactly once.
+    const int kThreads = 8;
+    const uint64_t kKeys = 200000;
+    concurrent_dense_hash_set<uint64_t, google::fast_hash<uint64_t>> set(
+        0, ~uint64_t(0));
+    std::atomic<uint64_t> num_new(0);
+    std::atomic<bool> all_found(true);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreads; ++t) {
+        threads.push_back(std::thread([&, t]() {
+            uint64_t mine = 0;
+            for (uint64_t i = 0; i < kKeys; ++i) {
+                const uint64_t key = (i * 2654435761u + t * 7919) % kKeys + 1;
+                if (set.insert(key)) ++mine;
+                if (!set.contains(key)) all_found = false;
+            }
+            num_new += mine;
+        }));
+    }
+    for (size_t t = 0; t < threads.size(); ++t)
+        threads[t].join();
+    ASSERT_TRUE(all_found);
+    ASSERT_EQ(kKeys, num_new.load());
+    ASSERT_EQ(kKeys, set.size());
+    for (uint64_t key = 1; key <= kKeys; ++key)
+        ASSERT_TRUE(set.contains(key)) << key;
+}
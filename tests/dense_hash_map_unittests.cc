@@ -2,10 +2,32 @@
 // Created by Lukas Barth on 17.04.18.
 //
 
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
 #include "gtest/gtest.h"
 #include "sparsehash/dense_hash_map"
+#include "sparsehash/packed"
 
 using google::dense_hash_map;
+using google::packed;
+
+namespace {
+struct BigValue {
+	uint64_t payload[15];
+};
+}
+
+namespace google {
+template <>
+struct dense_split_keys<std::pair<const uint64_t, BigValue>> : std::true_type {};
+}
 
 TEST(DenseHashMap, TestEmplaceHint) {
 	dense_hash_map<int, const char *> map;
@@ -18,4 +40,726 @@ TEST(DenseHashMap, TestEmplaceHint) {
 	map.emplace_hint(it, 1701, "World");
 
 	ASSERT_EQ(map.size(), 2u);
-}
\ No newline at end of file
+}
+
+TEST(DenseHashMap, NoEmptyKeyFullKeyRange) {
+	dense_hash_map<uint64_t, int> map;
+	const uint64_t max = std::numeric_limits<uint64_t>::max();
+
+	ASSERT_TRUE(map.empty());
+	ASSERT_TRUE(map.begin() == map.end());
+	ASSERT_EQ(map.count(0), 0u);
+
+	map[0] = 1;
+	map[max] = 2;
+	for (uint64_t i = 1; i <= 1000; ++i)
+		map.insert({i, int(i)});
+
+	ASSERT_EQ(map.size(), 1002u);
+	ASSERT_EQ(map[0], 1);
+	ASSERT_EQ(map[max], 2);
+	ASSERT_EQ(map.find(500)->second, 500);
+
+	size_t seen = 0;
+	for (auto it = map.begin(); it != map.end(); ++it)
+		++seen;
+	ASSERT_EQ(seen, map.size());
+}
+
+TEST(DenseHashMap, NoEmptyKeyEraseWithoutDeletedKey) {
+	dense_hash_map<std::string, std::string> map;
+
+	for (int i = 0; i < 100; ++i)
+		map[std::to_string(i)] = std::string(i, 'x');
+	for (int i = 0; i < 100; i += 2)
+		ASSERT_EQ(map.erase(std::to_string(i)), 1u);
+	ASSERT_EQ(map.erase("0"), 0u);
+
+	ASSERT_EQ(map.size(), 50u);
+	ASSERT_TRUE(map.find("10") == map.end());
+	ASSERT_EQ(map["11"], std::string(11, 'x'));
+
+	// Reinsert into deleted buckets, then force a rehash.
+	map["10"] = "ten";
+	map.resize(1000);
+	ASSERT_EQ(map.size(), 51u);
+	ASSERT_EQ(map["10"], "ten");
+
+	dense_hash_map<std::string, std::string> copy(map);
+	ASSERT_TRUE(copy == map);
+	copy.clear();
+	ASSERT_TRUE(copy.empty());
+	copy = map;
+	ASSERT_EQ(copy.size(), 51u);
+}
+
+TEST(DenseHashMap, NoEmptyKeySerialize) {
+	dense_hash_map<uint64_t, uint64_t> map;
+	for (uint64_t i = 0; i < 100; ++i)
+		map[i] = i * 3;
+	map.erase(7);
+
+	std::stringstream ss;
+	ASSERT_TRUE(map.serialize(dense_hash_map<uint64_t, uint64_t>::NopointerSerializer(), &ss));
+
+	dense_hash_map<uint64_t, uint64_t> map2;
+	ASSERT_TRUE(map2.unserialize(dense_hash_map<uint64_t, uint64_t>::NopointerSerializer(), &ss));
+	ASSERT_EQ(map2.size(), 99u);
+	ASSERT_TRUE(map2.find(7) == map2.end());
+	ASSERT_EQ(map2[0], 0u);
+	ASSERT_EQ(map2[99], 297u);
+}
+
+namespace {
+// A custom stream that counts how often the table calls it.
+struct CountingStream {
+	std::string data;
+	size_t pos = 0;
+	size_t calls = 0;
+	size_t Write(const void* p, size_t n) {
+		++calls;
+		data.append(static_cast<const char*>(p), n);
+		return n;
+	}
+	size_t Read(void* p, size_t n) {
+		++calls;
+		n = std::min(n, data.size() - pos);
+		memcpy(p, data.data() + pos, n);
+		pos += n;
+		return n;
+	}
+};
+}
+
+TEST(DenseHashMap, BufferedSerialize) {
+	typedef dense_hash_map<uint64_t, uint64_t> Map;
+	// One map with an empty key and a bucket count that isn't a
+	// multiple of 8, and one without an empty key.
+	Map keyed;
+	keyed.set_empty_key(0);
+	keyed.set_fine_grained_buckets(true);
+	Map unkeyed;
+	for (uint64_t i = 1; i <= 10000; ++i) {
+		keyed[i] = i * 3;
+		unkeyed[i * 7] = i;
+	}
+	ASSERT_NE(keyed.bucket_count() % 8, 0u);
+
+	// Back to back, with something after them that reading mustn't eat.
+	CountingStream stream;
+	ASSERT_TRUE(keyed.serialize(Map::NopointerSerializer(), &stream));
+	ASSERT_TRUE(unkeyed.serialize(Map::NopointerSerializer(), &stream));
+	stream.Write("end", 3);
+	// Far fewer calls than buckets or values.
+	ASSERT_LT(stream.calls, 50u);
+
+	Map keyed2, unkeyed2;
+	keyed2.set_empty_key(0);
+	keyed2.set_fine_grained_buckets(true);
+	stream.calls = 0;
+	ASSERT_TRUE(keyed2.unserialize(Map::NopointerSerializer(), &stream));
+	ASSERT_TRUE(unkeyed2.unserialize(Map::NopointerSerializer(), &stream));
+	ASSERT_LT(stream.calls, 50u);
+	char end[3];
+	ASSERT_EQ(stream.Read(end, 3), 3u);
+	ASSERT_EQ(std::string(end, 3), "end");
+
+	ASSERT_TRUE(keyed2 == keyed);
+	ASSERT_TRUE(unkeyed2 == unkeyed);
+	ASSERT_EQ(unkeyed2[70], 10u);
+	unkeyed2[5] = 5;  // the state bitmap is right
+	ASSERT_EQ(unkeyed2.size(), 10001u);
+
+	// A stream cut short fails cleanly.
+	CountingStream cut;
+	cut.data = stream.data.substr(0, stream.data.size() / 3);
+	ASSERT_FALSE(keyed2.unserialize(Map::NopointerSerializer(), &cut));
+}
+
+TEST(DenseHashMap, SplitKeys) {
+	dense_hash_map<uint64_t, BigValue> map;
+	map.set_empty_key(0);
+	map.set_deleted_key(1);
+
+	for (uint64_t i = 2; i < 1000; ++i)
+		map[i].payload[0] = i * 7;
+	for (uint64_t i = 2; i < 1000; i += 3)
+		ASSERT_EQ(map.erase(i), 1u);
+
+	ASSERT_EQ(map.size(), 665u);
+	ASSERT_TRUE(map.find(2) == map.end());
+	ASSERT_EQ(map.find(3)->second.payload[0], 21u);
+
+	// Reuse deleted buckets, then rehash into a fresh key array.
+	map[5].payload[0] = 5;
+	map.resize(5000);
+	ASSERT_EQ(map.size(), 666u);
+	ASSERT_EQ(map[5].payload[0], 5u);
+	ASSERT_EQ(map.count(8), 0u);
+
+	// Batches prefetch the key array, since that is what they probe.
+	std::vector<std::pair<uint64_t, BigValue>> batch(100);
+	for (size_t i = 0; i < batch.size(); ++i)
+		batch[i].first = 2000 + i;
+	ASSERT_EQ(map.insert_batch(batch.begin(), batch.end()), 100u);
+	ASSERT_EQ(map.count(2099), 1u);
+	ASSERT_EQ(map.erase(2099), 1u);
+
+	dense_hash_map<uint64_t, BigValue> copy(map);
+	ASSERT_EQ(copy.size(), map.size());
+	ASSERT_EQ(copy.find(999)->second.payload[0], 999u * 7);
+	copy.clear();
+	ASSERT_TRUE(copy.find(999) == copy.end());
+
+	dense_hash_map<uint64_t, BigValue> nokey;
+	nokey[0].payload[0] = 42;
+	nokey.erase(0);
+	nokey[0].payload[0] = 43;
+	ASSERT_EQ(nokey.size(), 1u);
+	ASSERT_EQ(nokey[0].payload[0], 43u);
+}
+
+TEST(DenseHashMap, PackedKeys) {
+	typedef dense_hash_map<packed<uint64_t>, uint32_t> Map;
+	ASSERT_EQ(sizeof(Map::value_type), 12u);
+	ASSERT_EQ(sizeof(dense_hash_map<packed<uint32_t>, uint8_t>::value_type), 5u);
+
+	Map map;
+	map.set_empty_key(0);
+	map.set_deleted_key(std::numeric_limits<uint64_t>::max());
+	for (uint64_t i = 1; i <= 1000; ++i)
+		map[i << 32] = uint32_t(i);
+	ASSERT_EQ(map.erase(uint64_t(7) << 32), 1u);
+
+	ASSERT_EQ(map.size(), 999u);
+	ASSERT_EQ(map[uint64_t(5) << 32], 5u);
+	ASSERT_TRUE(map.find(uint64_t(7) << 32) == map.end());
+	ASSERT_EQ(map.count(5), 0u);
+
+	uint64_t sum = 0;
+	for (const auto& kv : map)
+		sum += kv.first.get() >> 32;
+	ASSERT_EQ(sum, 1000u * 1001 / 2 - 7);
+	// The identity hash of these keys has no low bits, so this only
+	// holds if packed keys get the same hash munging as plain ones.
+	ASSERT_LT(map.compute_stats().max_displacement, 64u);
+}
+
+TEST(DenseHashMap, FineGrainedBuckets) {
+	dense_hash_map<int, int> map;
+	map.set_empty_key(-1);
+	map.set_deleted_key(-2);
+	map.set_fine_grained_buckets(true);
+	ASSERT_TRUE(map.fine_grained_buckets());
+
+	size_t last_buckets = map.bucket_count();
+	for (int i = 0; i < 10000; ++i) {
+		map[i] = i;
+		// Growth steps are about 1.25x, never a doubling.
+		ASSERT_LE(map.bucket_count(), last_buckets + last_buckets / 4 + 1);
+		last_buckets = map.bucket_count();
+	}
+	ASSERT_NE(map.bucket_count() & (map.bucket_count() - 1), 0u);
+
+	for (int i = 0; i < 10000; i += 2)
+		ASSERT_EQ(map.erase(i), 1u);
+	ASSERT_EQ(map.size(), 5000u);
+	for (int i = 0; i < 10000; ++i)
+		ASSERT_EQ(map.count(i), size_t(i % 2));
+
+	// Switching back rehashes into a power-of-two table.
+	map.set_fine_grained_buckets(false);
+	ASSERT_EQ(map.bucket_count() & (map.bucket_count() - 1), 0u);
+	ASSERT_EQ(map.size(), 5000u);
+	ASSERT_EQ(map[9999], 9999);
+	ASSERT_TRUE(map.find(9998) == map.end());
+}
+
+TEST(DenseHashMap, ResizePolicyGrowthAndShrinkDelay) {
+	dense_hash_map<int, int> map;
+	map.set_empty_key(-1);
+	map.set_deleted_key(-2);
+	google::resize_policy policy;
+	policy.growth_factor = 4;
+	policy.shrink_delay = 10;
+	map.set_resize_policy(policy);
+	ASSERT_EQ(map.get_resize_policy().shrink_delay, 10u);
+
+	map.resize(100);
+	const size_t start = map.bucket_count();
+	for (int i = 0; i < 1000; ++i)
+		map[i] = i;
+	ASSERT_EQ(map.bucket_count() & (map.bucket_count() - 1), 0u);
+	// Each growth step is a quadrupling.
+	for (size_t b = start; b != map.bucket_count(); b *= 4)
+		ASSERT_LT(b, map.bucket_count());
+
+	const size_t full = map.bucket_count();
+	for (int i = 10; i < 1000; ++i)
+		map.erase(i);
+	// Erases interleaved with inserts keep the table from shrinking.
+	for (int i = 0; i < 50; ++i) {
+		map[2000 + i] = i;
+		map.erase(2000 + i);
+	}
+	ASSERT_EQ(map.bucket_count(), full);
+	for (int i = 0; i < 11; ++i)
+		map[3000 + i] = i;
+	ASSERT_LT(map.bucket_count(), full);
+	ASSERT_EQ(map.size(), 21u);
+}
+
+TEST(DenseHashMap, ResizePolicyMemoryBudget) {
+	dense_hash_map<int, int> map;
+	map.set_empty_key(-1);
+	map.set_deleted_key(-2);
+	google::resize_policy policy;
+	policy.max_bytes = 64 * sizeof(std::pair<const int, int>);
+	map.set_resize_policy(policy);
+
+	// The table stops growing at 64 buckets and fills up instead.
+	for (int i = 0; i < 63; ++i)
+		map[i] = i;
+	ASSERT_EQ(map.bucket_count(), 64u);
+	ASSERT_EQ(map[62], 62);
+	ASSERT_THROW(map[63] = 63, std::length_error);
+
+	// Erasing makes room again.
+	map.erase(0);
+	map[63] = 63;
+	ASSERT_EQ(map.size(), 63u);
+	ASSERT_EQ(map.bucket_count(), 64u);
+	ASSERT_EQ(map[63], 63);
+	ASSERT_EQ(map.count(0), 0u);
+}
+
+namespace {
+// Counts live copies, and can be made to throw when copied.
+struct Tracked {
+	static int live;
+	static int copies_until_throw;  // never throws if negative
+	int value;
+	explicit Tracked(int v = 0) : value(v) { ++live; }
+	Tracked(const Tracked& t) : value(t.value) {
+		if (copies_until_throw >= 0 && copies_until_throw-- == 0)
+			throw std::runtime_error("copy failed");
+		++live;
+	}
+	Tracked(Tracked&& t) noexcept : value(t.value) { ++live; }
+	Tracked& operator=(const Tracked& t) { value = t.value; return *this; }
+	~Tracked() { --live; }
+};
+int Tracked::live = 0;
+int Tracked::copies_until_throw = -1;
+}
+
+TEST(DenseHashMap, ResizePolicyRehashStrategy) {
+	const google::resize_policy::rehash_strategy_type strategies[] = {
+		google::resize_policy::REHASH_DIRECT,
+		google::resize_policy::REHASH_PREFETCH,
+		google::resize_policy::REHASH_PARTITIONED};
+	// Enough elements for the partitioned strategy to use a few
+	// partitions, with and without an empty key, and with fine-grained
+	// buckets.
+	const int n = 20000;
+	for (auto strategy : strategies) {
+		for (int mode = 0; mode < 3; ++mode) {
+			dense_hash_map<int, std::string> map;
+			if (mode != 1)
+				map.set_empty_key(-1);
+			map.set_deleted_key(-2);
+			if (mode == 2)
+				map.set_fine_grained_buckets(true);
+			google::resize_policy policy;
+			policy.rehash_strategy = strategy;
+			map.set_resize_policy(policy);
+			for (int i = 0; i < n; ++i)
+				map[i] = std::to_string(i);
+			for (int i = 0; i < n; i += 2)
+				map.erase(i);
+			map.resize(4 * n);  // a rehash with deleted buckets to drop
+
+			const dense_hash_map<int, std::string> copy(map);
+			ASSERT_EQ(map.size(), size_t(n / 2));
+			ASSERT_EQ(copy.size(), size_t(n / 2));
+			for (int i = 0; i < n; ++i) {
+				ASSERT_EQ(map.count(i), size_t(i % 2));
+				if (i % 2) {
+					ASSERT_EQ(copy.find(i)->second, std::to_string(i));
+				}
+			}
+			// Every element is where a probe from its home bucket finds
+			// it first.
+			ASSERT_EQ(map.compute_stats().size, size_t(n / 2));
+		}
+	}
+
+	// A copy that throws half way through leaves nothing behind.  (No
+	// empty key, so only the elements are Tracked objects.)
+	{
+		dense_hash_map<int, Tracked> map;
+		google::resize_policy policy;
+		policy.rehash_strategy = google::resize_policy::REHASH_PARTITIONED;
+		map.set_resize_policy(policy);
+		for (int i = 0; i < n; ++i)
+			map[i] = Tracked(i);
+		dense_hash_map<int, Tracked> copy;
+		Tracked::copies_until_throw = n / 2;
+		ASSERT_THROW(copy = map, std::runtime_error);
+		Tracked::copies_until_throw = -1;
+		ASSERT_EQ(copy.size(), 0u);
+		copy = map;
+		ASSERT_EQ(copy.size(), size_t(n));
+		ASSERT_EQ(copy.find(n - 1)->second.value, n - 1);
+	}
+	ASSERT_EQ(Tracked::live, 0);
+}
+
+namespace {
+// Claims to avalanche, so the table uses its hashes as they are.
+struct CollidingHash {
+	typedef void is_avalanching;
+	size_t operator()(int i) const { return size_t(i) << 12; }
+};
+}
+
+TEST(DenseHashMap, ResizePolicyProbeLength) {
+	dense_hash_map<int, int, CollidingHash> plain;
+	dense_hash_map<int, int, CollidingHash> map;
+	plain.set_empty_key(-1);
+	map.set_empty_key(-1);
+	google::resize_policy policy;
+	policy.max_probe_length = 4;
+	map.set_resize_policy(policy);
+
+	for (int i = 0; i < 100; ++i) {
+		plain[i] = i;
+		map[i] = i;
+	}
+	// Long probe chains made the table grow before it got half full.
+	ASSERT_GT(map.bucket_count(), plain.bucket_count());
+	for (int i = 0; i < 100; ++i)
+		ASSERT_EQ(map[i], i);
+}
+
+namespace {
+void record_resize(const google::resize_event& event, void* arg) {
+	static_cast<std::vector<google::resize_event>*>(arg)->push_back(event);
+}
+}
+
+TEST(DenseHashMap, ResizeObserver) {
+	std::vector<google::resize_event> events;
+	dense_hash_map<int, int> map;
+	map.set_deleted_key(-2);
+	map.set_resize_observer(record_resize, &events);
+
+	for (int i = 0; i < 100; ++i)
+		map[i] = i;
+	ASSERT_FALSE(events.empty());
+	ASSERT_EQ(0u, events.size() % 2);
+	for (size_t i = 0; i < events.size(); i += 2) {
+		const google::resize_event& before = events[i];
+		const google::resize_event& after = events[i + 1];
+		ASSERT_FALSE(before.done);
+		ASSERT_TRUE(after.done);
+		ASSERT_EQ(google::resize_event::RESIZE, before.reason);
+		ASSERT_EQ(before.old_bucket_count, after.old_bucket_count);
+		ASSERT_EQ(before.new_bucket_count, after.new_bucket_count);
+		ASSERT_LT(after.old_bucket_count, after.new_bucket_count);
+		ASSERT_EQ(before.num_elements, after.num_elements);
+		ASSERT_EQ(0u, before.elapsed_ns);
+	}
+	ASSERT_EQ(map.bucket_count(), events.back().new_bucket_count);
+
+	events.clear();
+	for (int i = 0; i < 100; ++i)
+		map.erase(i);
+	map[1000] = 1;  // the next insert shrinks the table
+	ASSERT_EQ(2u, events.size());
+	ASSERT_EQ(google::resize_event::SHRINK, events[0].reason);
+	ASSERT_GT(events[1].old_bucket_count, events[1].new_bucket_count);
+
+	events.clear();
+	map.set_resize_observer(NULL);
+	map.set_fine_grained_buckets(true);
+	ASSERT_TRUE(events.empty());
+}
+
+TEST(DenseHashMap, PrecomputedHash) {
+	dense_hash_map<std::string, int> names;
+	dense_hash_map<std::string, int> seeded;
+	seeded.set_seeded_hashing(true);
+
+	for (int i = 0; i < 200; ++i) {
+		const std::string key = std::to_string(i);
+		const size_t hash = names.hash_function_value(key);
+		ASSERT_EQ(hash, seeded.hash_function_value(key));
+		ASSERT_TRUE(names.insert(std::make_pair(key, i), hash).second);
+		ASSERT_TRUE(seeded.insert(std::make_pair(key, i), hash).second);
+		ASSERT_FALSE(seeded.insert(std::make_pair(key, -1), hash).second);
+	}
+	ASSERT_EQ(200u, names.size());
+	ASSERT_EQ(200u, seeded.size());
+
+	seeded.set_hash_seed(seeded.hash_seed() + 1);
+	for (int i = 0; i < 200; ++i) {
+		const std::string key = std::to_string(i);
+		const size_t hash = names.hash_function_value(key);
+		ASSERT_EQ(i, names.find(key, hash)->second);
+		ASSERT_EQ(i, seeded.find(key, hash)->second);
+		ASSERT_EQ(1u, seeded.count(key, hash));
+		ASSERT_EQ(names.find(key), names.find(key, hash));
+	}
+
+	const std::string gone = "17";
+	ASSERT_EQ(1u, names.erase(gone, names.hash_function_value(gone)));
+	ASSERT_EQ(0u, names.erase(gone, names.hash_function_value(gone)));
+	ASSERT_TRUE(names.find(gone, names.hash_function_value(gone)) == names.end());
+	ASSERT_EQ(199u, names.size());
+}
+
+TEST(DenseHashMap, LookupHandle) {
+	dense_hash_map<std::string, int> map;
+	map.set_empty_key("");
+
+	const std::string key = "apple";
+	dense_hash_map<std::string, int>::lookup_handle handle = map.prepare(key);
+	ASSERT_FALSE(handle.found());
+	dense_hash_map<std::string, int>::iterator it = handle.emplace(key, 1);
+	ASSERT_TRUE(handle.found());
+	ASSERT_EQ(it, handle.position());
+	ASSERT_EQ(1, map[key]);
+
+	handle = map.prepare(key);
+	ASSERT_TRUE(handle.found());
+	handle.position()->second = 5;
+	ASSERT_EQ(5, map[key]);
+
+	// Emplacing through a handle still grows the table when it must.
+	for (int i = 0; i < 1000; ++i) {
+		const std::string k = std::to_string(i);
+		map.prepare(k).emplace(k, i);
+	}
+	ASSERT_EQ(1001u, map.size());
+	for (int i = 0; i < 1000; ++i)
+		ASSERT_EQ(i, map[std::to_string(i)]);
+}
+
+TEST(DenseHashMap, InsertOrMerge) {
+	dense_hash_map<int, std::string> map;
+	const auto append = [](std::string& existing, const std::string& value) {
+		existing += value;
+	};
+	ASSERT_TRUE(map.insert_or_merge(1, std::string("a"), append).second);
+	ASSERT_FALSE(map.insert_or_merge(1, std::string("b"), append).second);
+	ASSERT_TRUE(map.insert_or_merge(2, std::string("c"), append).second);
+	ASSERT_EQ("ab", map[1]);
+	ASSERT_EQ("c", map[2]);
+	ASSERT_EQ(2u, map.size());
+}
+
+TEST(DenseHashMap, InsertBatch) {
+	std::vector<std::pair<int, int>> values;
+	for (int i = 0; i < 1000; ++i)
+		values.push_back(std::make_pair(i % 700, i));
+
+	dense_hash_map<int, int> inserted;
+	ASSERT_EQ(700u, inserted.insert_batch(values.begin(), values.end()));
+	ASSERT_EQ(700u, inserted.size());
+	for (int i = 0; i < 700; ++i)
+		ASSERT_EQ(i, inserted[i]);  // the first value for a key wins
+
+	dense_hash_map<int, int> upserted;
+	upserted.set_empty_key(-1);
+	upserted[5] = -5;
+	ASSERT_EQ(699u, upserted.upsert_batch(values.begin(), values.end()));
+	ASSERT_EQ(700u, upserted.size());
+	ASSERT_EQ(705, upserted[5]);  // the last value for a key wins
+	ASSERT_EQ(699, upserted[699]);
+
+	dense_hash_map<int, int> summed;
+	ASSERT_EQ(700u, summed.upsert_batch(values.begin(), values.end(),
+	                                    [](int& sum, int value) { sum += value; }));
+	ASSERT_EQ(5 + 705, summed[5]);
+	ASSERT_EQ(699, summed[699]);
+}
+
+namespace {
+// Runs the tasks in reverse on the calling thread, counting them.
+struct CountingExecutor {
+	size_t* num_tasks;
+	template <class Task>
+	void operator()(size_t n, Task task) {
+		*num_tasks += n;
+		for (size_t i = n; i > 0; --i)
+			task(i - 1);
+	}
+};
+}  // namespace
+
+TEST(DenseHashMap, ParallelSweeps) {
+	const int kSize = 100000;  // several PARALLEL_CHUNKs of buckets
+	dense_hash_map<int, int> bitmap;
+	dense_hash_map<int, int> keyed;
+	keyed.set_empty_key(-1);
+	keyed.set_deleted_key(-2);
+	for (int i = 0; i < kSize; ++i) {
+		bitmap[i] = i;
+		keyed[i] = i;
+	}
+
+	for (dense_hash_map<int, int>* map : {&bitmap, &keyed}) {
+		map->parallel_for_each([](std::pair<const int, int>& v) { v.second *= 2; }, 4);
+		ASSERT_EQ(2 * 123, (*map)[123]);
+
+		const auto add = [](int64_t& sum, const std::pair<const int, int>& v) { sum += v.second; };
+		const auto combine = [](int64_t& sum, const int64_t& partial) { sum += partial; };
+		ASSERT_EQ(int64_t(kSize) * (kSize - 1), map->parallel_reduce(int64_t(0), add, combine, 3));
+
+		size_t num_tasks = 0;
+		ASSERT_EQ(size_t(kSize / 2), map->parallel_erase_if(
+		    [](const std::pair<const int, int>& v) { return v.first % 2 == 1; },
+		    CountingExecutor{&num_tasks}));
+		ASSERT_LT(1u, num_tasks);
+		ASSERT_EQ(size_t(kSize / 2), map->size());
+		ASSERT_EQ(0u, map->count(7));
+		ASSERT_EQ(16, (*map)[8]);
+
+		// A throwing predicate still leaves the count right.
+		int seen = 0;
+		ASSERT_THROW(map->parallel_erase_if([&seen](const std::pair<const int, int>&) {
+			if (++seen > 10) throw std::runtime_error("stop");
+			return true;
+		}, 1), std::runtime_error);
+		ASSERT_EQ(size_t(kSize / 2 - 10), map->size());
+		size_t counted = 0;
+		for (auto it = map->begin(); it != map->end(); ++it)
+			++counted;
+		ASSERT_EQ(map->size(), counted);
+	}
+}
+
+namespace {
+// Gives runs of 512 keys the same home bucket, so that their probe
+// sequences run out of the ranges parallel_insert() splits the table into.
+struct ClusteringHash {
+	typedef void is_avalanching;
+	size_t operator()(int i) const { return size_t(i / 512) * 7919; }
+};
+
+template <class Map>
+void ExpectParallelInsertMatchesInsertBatch(Map& parallel, Map& serial,
+                                            const std::vector<std::pair<int, int>>& values) {
+	const auto add = [](int& sum, int value) { sum += value; };
+	ASSERT_EQ(serial.upsert_batch(values.begin(), values.end(), add),
+	          parallel.parallel_upsert(values.begin(), values.end(), add, 4));
+	ASSERT_EQ(serial.insert_batch(values.rbegin(), values.rend()),
+	          parallel.parallel_insert(values.rbegin(), values.rend(), 3));
+	ASSERT_EQ(serial.size(), parallel.size());
+	size_t counted = 0;
+	for (auto it = parallel.begin(); it != parallel.end(); ++it, ++counted)
+		ASSERT_EQ(serial[it->first], it->second);
+	ASSERT_EQ(serial.size(), counted);
+}
+}  // namespace
+
+TEST(DenseHashMap, ParallelInsert) {
+	std::vector<std::pair<int, int>> values;
+	for (int i = 0; i < 200000; ++i)
+		values.push_back(std::make_pair((i * 7) % 150000, i));
+
+	dense_hash_map<int, int> bitmap, bitmap_serial;
+	bitmap[3] = 1000;  // merges with what is there already
+	bitmap_serial[3] = 1000;
+	ExpectParallelInsertMatchesInsertBatch(bitmap, bitmap_serial, values);
+
+	dense_hash_map<int, int> keyed, keyed_serial;
+	keyed.set_empty_key(-1);
+	keyed_serial.set_empty_key(-1);
+	keyed.set_fine_grained_buckets(true);
+	keyed_serial.set_fine_grained_buckets(true);
+	ExpectParallelInsertMatchesInsertBatch(keyed, keyed_serial, values);
+
+	std::vector<std::pair<int, int>> clustered_values(values.begin(), values.begin() + 20000);
+	for (size_t i = 0; i < clustered_values.size(); ++i)
+		clustered_values[i].first %= 10000;
+	dense_hash_map<int, int, ClusteringHash> clustered, clustered_serial;
+	ExpectParallelInsertMatchesInsertBatch(clustered, clustered_serial, clustered_values);
+	for (int i = 0; i < 10000; ++i)
+		ASSERT_EQ(1u, clustered.count(i));
+}
+
+namespace {
+// A serializer that takes any stream, as the chunked format needs.
+struct ByteSwappingSerializer {
+	template <class OUTPUT>
+	bool operator()(OUTPUT* out, const std::pair<const int, int>& v) {
+		return google::sparsehash_internal::write_bigendian_number(out, uint32_t(v.first), 4) &&
+		       google::sparsehash_internal::write_bigendian_number(out, uint32_t(v.second), 4);
+	}
+	template <class INPUT>
+	bool operator()(INPUT* in, std::pair<const int, int>* v) {
+		uint32_t key, value;
+		if (!google::sparsehash_internal::read_bigendian_number(in, &key, 4) ||
+		    !google::sparsehash_internal::read_bigendian_number(in, &value, 4))
+			return false;
+		new (v) std::pair<const int, int>(int(key), int(value));
+		return true;
+	}
+};
+}  // namespace
+
+TEST(DenseHashMap, ParallelSerialize) {
+	typedef dense_hash_map<int, int> Map;
+	Map bitmap;
+	Map keyed;
+	keyed.set_empty_key(-1);
+	keyed.set_deleted_key(-2);
+	for (int i = 0; i < 100000; ++i) {  // several chunks
+		bitmap[i * 3] = i;
+		keyed[i * 3] = i;
+	}
+	bitmap.erase(30);
+	keyed.erase(30);
+
+	for (Map* map : {&bitmap, &keyed}) {
+		FILE* pod_file = std::tmpfile();
+		FILE* generic_file = std::tmpfile();
+		ASSERT_TRUE(pod_file && generic_file);
+		size_t num_tasks = 0;
+		ASSERT_TRUE(map->parallel_serialize(Map::NopointerSerializer(), fileno(pod_file),
+		                                    CountingExecutor{&num_tasks}));
+		ASSERT_LT(2u, num_tasks);
+		ASSERT_TRUE(map->parallel_serialize(ByteSwappingSerializer(), fileno(generic_file), 2));
+
+		Map pod_copy, generic_copy;
+		if (map == &keyed) {
+			pod_copy.set_empty_key(-1);
+			generic_copy.set_empty_key(-1);
+		}
+		ASSERT_TRUE(pod_copy.parallel_unserialize(Map::NopointerSerializer(), fileno(pod_file), 2));
+		ASSERT_TRUE(generic_copy.parallel_unserialize(ByteSwappingSerializer(), fileno(generic_file),
+		                                              CountingExecutor{&num_tasks}));
+		for (Map* copy : {&pod_copy, &generic_copy}) {
+			ASSERT_TRUE(*copy == *map);
+			ASSERT_EQ(0u, copy->count(30));
+			ASSERT_EQ(7, (*copy)[21]);
+			(*copy)[1] = 1;  // the states are right
+			ASSERT_EQ(map->size() + 1, copy->size());
+		}
+
+		// Neither format reads as the other.
+		Map other;
+		if (map == &keyed)
+			other.set_empty_key(-1);
+		ASSERT_FALSE(other.unserialize(Map::NopointerSerializer(), pod_file));
+		FILE* serial_file = std::tmpfile();
+		ASSERT_TRUE(map->serialize(Map::NopointerSerializer(), serial_file));
+		std::fflush(serial_file);
+		ASSERT_FALSE(other.parallel_unserialize(Map::NopointerSerializer(), fileno(serial_file)));
+		std::fclose(serial_file);
+		std::fclose(pod_file);
+		std::fclose(generic_file);
+	}
+}
@@ -2,6 +2,8 @@
 // Created by Lukas Barth on 17.04.18.
 //
 
+#include <cstdint>
+#include <limits>
 #include "gtest/gtest.h"
 #include "sparsehash/dense_hash_set"
 
@@ -35,4 +37,29 @@ TEST(DenseHashSet, TestEmplaceHintAfterDelete) {
 
 	auto deleted_iterator = set.erase(str1_inserted_it);
 	set.emplace_hint(deleted_iterator, str1);
-}
\ No newline at end of file
+}
+
+TEST(DenseHashSet, NoEmptyKey) {
+	dense_hash_set<int64_t> set;
+	const int64_t min = std::numeric_limits<int64_t>::min();
+
+	set.insert(0);
+	set.insert(-1);
+	set.insert(min);
+	for (int64_t i = 1; i <= 200; ++i)
+		set.insert(i);
+	ASSERT_EQ(set.size(), 203u);
+
+	auto it = set.find(min);
+	ASSERT_TRUE(it != set.end());
+	set.erase(it);
+	ASSERT_EQ(set.erase(0), 1u);
+	ASSERT_EQ(set.count(min), 0u);
+	ASSERT_EQ(set.count(-1), 1u);
+
+	set.erase(set.begin(), set.end());
+	ASSERT_TRUE(set.empty());
+	ASSERT_TRUE(set.begin() == set.end());
+	set.insert(0);
+	ASSERT_EQ(set.count(0), 1u);
+}
@@ -0,0 +1,131 @@
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "gtest/gtest.h"
+#include "sparsehash/dense_node_hash_map"
+
+using google::dense_node_hash_map;
+
+namespace {
+struct BigValue {
+	BigValue(int i = 0) : i(i) { ++live; }
+	BigValue(const BigValue& o) : i(o.i) { ++live; }
+	BigValue& operator=(const BigValue& o) { i = o.i; return *this; }
+	~BigValue() { --live; }
+	int i;
+	char payload[1024];
+	static int live;
+};
+int BigValue::live = 0;
+
+struct MaybeThrows {
+	explicit MaybeThrows(bool fail) {
+		if (fail) throw std::runtime_error("MaybeThrows");
+	}
+};
+}
+
+TEST(DenseNodeHashMap, ReferencesSurviveResize) {
+	dense_node_hash_map<int, BigValue> map;
+	map[0] = BigValue(0);
+	BigValue* first = &map[0];
+	std::vector<const BigValue*> ptrs;
+	for (int i = 1; i < 1000; ++i)
+		ptrs.push_back(&map.emplace(i, BigValue(i)).first->second);
+	ASSERT_GT(map.bucket_count(), 1024u);
+
+	ASSERT_EQ(first, &map[0]);
+	for (int i = 1; i < 1000; ++i) {
+		ASSERT_EQ(ptrs[i - 1], &map.at(i));
+		ASSERT_EQ(i, map.at(i).i);
+	}
+}
+
+TEST(DenseNodeHashMap, EraseDestroysAndReuses) {
+	{
+		dense_node_hash_map<int, BigValue> map;
+		for (int i = 0; i < 100; ++i)
+			map.try_emplace(i, i);
+		ASSERT_EQ(100, BigValue::live);
+
+		const BigValue* gone = &map[42];
+		ASSERT_EQ(1u, map.erase(42));
+		ASSERT_EQ(0u, map.erase(42));
+		ASSERT_EQ(99, BigValue::live);
+		ASSERT_EQ(map.end(), map.find(42));
+
+		// The freed slot is the next one handed out.
+		ASSERT_EQ(gone, &map.try_emplace(1000, 1000).first->second);
+
+		map.erase(map.begin(), map.end());
+		ASSERT_TRUE(map.empty());
+		ASSERT_EQ(0, BigValue::live);
+		map[1].i = 1;
+		map.clear();
+		ASSERT_EQ(0, BigValue::live);
+		map[2].i = 2;
+	}
+	ASSERT_EQ(0, BigValue::live);
+}
+
+TEST(DenseNodeHashMap, NoEmptyOrDeletedKey) {
+	// Every key is legal, and erase() works without set_deleted_key().
+	dense_node_hash_map<std::string, std::unique_ptr<int>> map;
+	map.emplace("", std::unique_ptr<int>(new int(1)));
+	map.emplace("a", std::unique_ptr<int>(new int(2)));
+	ASSERT_FALSE(map.emplace("a", std::unique_ptr<int>(new int(3))).second);
+	ASSERT_EQ(1, *map.at(""));
+	ASSERT_EQ(2, *map.at("a"));
+	ASSERT_EQ(1u, map.erase(""));
+	ASSERT_EQ(1u, map.size());
+	ASSERT_THROW(map.at(""), std::out_of_range);
+}
+
+TEST(DenseNodeHashMap, CopyMoveAndCompare) {
+	dense_node_hash_map<int, std::string> a = {{1, "one"}, {2, "two"}};
+	dense_node_hash_map<int, std::string> b(a);
+	ASSERT_TRUE(a == b);
+	ASSERT_NE(&a[1], &b[1]);  // each map has its own values
+
+	const std::string* two = &b[2];
+	dense_node_hash_map<int, std::string> c(std::move(b));
+	ASSERT_EQ(two, &c[2]);  // moving keeps the values where they are
+	ASSERT_TRUE(b.empty());
+
+	c[3] = "three";
+	ASSERT_TRUE(a != c);
+	a = c;
+	ASSERT_TRUE(a == c);
+	int sum = 0;
+	for (const auto& p : a)
+		sum += p.first;
+	ASSERT_EQ(6, sum);
+}
+
+TEST(DenseNodeHashMap, InsertProbesOnce) {
+	// try_emplace() moves the key into the value after probing for it,
+	// through resizes too.
+	dense_node_hash_map<std::string, int> map;
+	for (int i = 0; i < 1000; ++i) {
+		std::string key(64, 'a' + i % 26);
+		key += std::to_string(i);
+		ASSERT_TRUE(map.try_emplace(std::move(key), i).second);
+	}
+	for (int i = 0; i < 1000; ++i) {
+		std::string key(64, 'a' + i % 26);
+		key += std::to_string(i);
+		ASSERT_EQ(i, map.at(key));
+		ASSERT_FALSE(map.insert(std::make_pair(key, -1)).second);
+		ASSERT_EQ(i, map.at(key));
+	}
+
+	// A value whose constructor throws leaves no trace.
+	dense_node_hash_map<int, MaybeThrows> throwing;
+	throwing.try_emplace(1, false);
+	ASSERT_THROW(throwing.try_emplace(2, true), std::runtime_error);
+	ASSERT_EQ(1u, throwing.size());
+	ASSERT_EQ(throwing.end(), throwing.find(2));
+	ASSERT_TRUE(throwing.try_emplace(2, false).second);
+	ASSERT_EQ(2u, throwing.size());
+}
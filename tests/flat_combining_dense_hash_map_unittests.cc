@@ -0,0 +1,135 @@
+#include <sparsehash/flat_combining_dense_hash_map>
+#include <sparsehash/hash>
+
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+using google::dense_hash_map;
+using google::flat_combining_dense_hash_map;
+
+TEST(FlatCombiningDenseHashMap, SingleThread)
+{
+    flat_combining_dense_hash_map<int, std::string> map;
+    ASSERT_TRUE(map.empty());
+    ASSERT_TRUE(map.insert(1, "one"));
+    ASSERT_FALSE(map.insert(1, "uno"));
+    ASSERT_TRUE(map.insert_or_assign(2, "two"));
+    ASSERT_FALSE(map.insert_or_assign(2, "dos"));
+    ASSERT_EQ(2u, map.size());
+
+    std::string value;
+    ASSERT_TRUE(map.find(1, &value));
+    ASSERT_EQ("one", value);
+    ASSERT_TRUE(map.find(2, &value));
+    ASSERT_EQ("dos", value);
+    ASSERT_FALSE(map.find(3, &value));
+    ASSERT_EQ(1u, map.count(2));
+
+    ASSERT_EQ(1u, map.erase(1));
+    ASSERT_EQ(0u, map.erase(1));
+    ASSERT_EQ(0u, map.count(1));
+    ASSERT_EQ(1u, map.with_map([](dense_hash_map<int, std::string>& m) {
+        return m.size();
+    }));
+}
+
+TEST(FlatCombiningDenseHashMap, InitialMap)
+{
+    dense_hash_map<int, int> initial;
+    initial.set_empty_key(-1);
+    initial.set_deleted_key(-2);
+    initial[7] = 70;
+    flat_combining_dense_hash_map<int, int> map(initial);
+    int value = 0;
+    ASSERT_TRUE(map.find(7, &value));
+    ASSERT_EQ(70, value);
+    ASSERT_EQ(1u, map.erase(7));
+    ASSERT_TRUE(map.insert(7, 71));
+}
+
+TEST(FlatCombiningDenseHashMap, ReseededHasher)
+{
+    // fast_hash<std::string> takes the seed, so every reseed changes
+    // what it returns, and the callers' copy of it goes stale.
+    typedef dense_hash_map<std::string, int, google::fast_hash<std::string>> Map;
+    Map initial;
+    initial.set_empty_key("");
+    initial.set_deleted_key("-");
+    initial.set_seeded_hashing(true, 1);  // reseeds often
+    const uint64_t first_seed = initial.hash_seed();
+    flat_combining_dense_hash_map<std::string, int, google::fast_hash<std::string>> map(initial);
+    for (int i = 0; i < 5000; ++i)
+        ASSERT_TRUE(map.insert(std::to_string(i), i));
+    ASSERT_NE(first_seed, map.with_map([](Map& m) { return m.hash_seed(); }));
+
+    for (int i = 0; i < 5000; ++i) {
+        int value = -1;
+        ASSERT_TRUE(map.find(std::to_string(i), &value));
+        ASSERT_EQ(i, value);
+    }
+    ASSERT_TRUE(map.insert_or_assign("7", 70) == false);
+    ASSERT_EQ(1u, map.erase("8"));
+    ASSERT_EQ(4999u, map.size());
+}
+
+struct ThrowingCopy {
+    ThrowingCopy() : fail(false) {}
+    explicit ThrowingCopy(bool f) : fail(f) {}
+    ThrowingCopy(const ThrowingCopy& other) : fail(other.fail) {
+        if (fail) throw std::runtime_error("copy");
+    }
+    ThrowingCopy& operator=(const ThrowingCopy& other) {
+        fail = other.fail;
+        return *this;
+    }
+    bool fail;
+};
+
+TEST(FlatCombiningDenseHashMap, ErrorsGoBackToTheCaller)
+{
+    flat_combining_dense_hash_map<int, ThrowingCopy> map;
+    ASSERT_THROW(map.insert(1, ThrowingCopy(true)), std::runtime_error);
+    ASSERT_EQ(0u, map.count(1));
+    ASSERT_TRUE(map.insert(1, ThrowingCopy(false)));  // the slot is reusable
+}
+
+TEST(FlatCombiningDenseHashMap, ConcurrentOperations)
+{
+    // More threads than slots, so some of them share.
+    const int kThreads = 80;
+    const int kPerThread = 500;
+    flat_combining_dense_hash_map<int, int> map;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreads; ++t) {
+        threads.emplace_back([&map, t]() {
+            for (int i = 0; i < kPerThread; ++i) {
+                const int key = t * kPerThread + i;
+                ASSERT_TRUE(map.insert(key, key));
+                int value = -1;
+                ASSERT_TRUE(map.find(key, &value));
+                ASSERT_EQ(key, value);
+                if (i % 2 == 0) {
+                    ASSERT_EQ(1u, map.erase(key));
+                } else {
+                    ASSERT_FALSE(map.insert_or_assign(key, -key));
+                }
+            }
+        });
+    }
+    for (size_t i = 0; i < threads.size(); ++i) threads[i].join();
+
+    ASSERT_EQ(static_cast<size_t>(kThreads * kPerThread / 2), map.size());
+    for (int key = 0; key < kThreads * kPerThread; ++key) {
+        int value = 0;
+        if (key % kPerThread % 2 == 0) {
+            ASSERT_FALSE(map.find(key, &value));
+        } else {
+            ASSERT_TRUE(map.find(key, &value));
+            ASSERT_EQ(-key, value);
+        }
+    }
+}
@@ -0,0 +1,208 @@
+#include <sparsehash/hash>
+#include <sparsehash/dense_hash_map>
+#include <sparsehash/sparse_hash_map>
+
+#include <bitset>
+#include <cstdint>
+#include <set>
+#include <string>
+
+#include "gtest/gtest.h"
+
+using google::dense_hash_map;
+using google::fast_hash;
+using google::hash_bytes;
+using google::hash_mix64;
+using google::sparse_hash_map;
+
+TEST(HashTest, Mix64SpreadsHighBits)
+{
+    // Keys that only differ above bit 10 must still land in different
+    // low bits, which is what the tables use to pick a bucket.
+    std::set<uint64_t> low_bits;
+    for (uint64_t i = 0; i < 1024; ++i)
+        low_bits.insert(hash_mix64(i << 10) & 1023);
+    ASSERT_GT(low_bits.size(), 600u);
+}
+
+TEST(HashTest, Mix64Avalanche)
+{
+    // Flipping one input bit flips about half the output bits.
+    int flipped = 0;
+    for (int bit = 0; bit < 64; ++bit)
+        flipped += static_cast<int>(std::bitset<64>(
+            hash_mix64(12345) ^ hash_mix64(12345 ^ (1ULL << bit))).count());
+    ASSERT_GT(flipped, 64 * 24);
+    ASSERT_LT(flipped, 64 * 40);
+}
+
+TEST(HashTest, HashBytesEveryLength)
+{
+    // Every length and every byte position takes part in the hash.
+    char buf[200];
+    for (size_t i = 0; i < sizeof(buf); ++i)
+        buf[i] = static_cast<char>(i * 7);
+    std::set<uint64_t> seen;
+    for (size_t len = 0; len <= sizeof(buf); ++len)
+        ASSERT_TRUE(seen.insert(hash_bytes(buf, len)).second) << len;
+    for (size_t len = 1; len <= sizeof(buf); len += 13) {
+        const uint64_t h = hash_bytes(buf, len);
+        for (size_t pos = 0; pos < len; ++pos) {
+            buf[pos] ^= 1;
+            ASSERT_NE(h, hash_bytes(buf, len)) << len << " " << pos;
+            buf[pos] ^= 1;
+        }
+    }
+    ASSERT_NE(hash_bytes(buf, 100, 1), hash_bytes(buf, 100, 2));
+    ASSERT_EQ(hash_bytes(buf, 100, 1), hash_bytes(buf, 100, 1));
+}
+
+TEST(HashTest, StringAndCharPointerAgree)
+{
+    fast_hash<std::string> h;
+    const std::string s = "a string longer than sixteen bytes";
+    ASSERT_EQ(h(s), h(s.c_str()));
+    ASSERT_EQ(h(std::string()), h(""));
+}
+
+TEST(HashTest, DenseHashMapWithFastHash)
+{
+    dense_hash_map<uint64_t, int, fast_hash<uint64_t>> m;
+    m.set_empty_key(~0ULL);
+    for (uint64_t i = 0; i < 1000; ++i)
+        m[i << 20] = static_cast<int>(i);
+    ASSERT_EQ(1000u, m.size());
+    for (uint64_t i = 0; i < 1000; ++i)
+        ASSERT_EQ(static_cast<int>(i), m[i << 20]);
+}
+
+TEST(HashTest, StringMapTransparentLookup)
+{
+    dense_hash_map<std::string, int, fast_hash<std::string>> d;
+    d.set_empty_key(std::string());
+    sparse_hash_map<std::string, int, fast_hash<std::string>> s;
+    d["apple"] = 1;
+    s["apple"] = 1;
+
+    const char* key = "apple";
+    ASSERT_EQ(1u, d.count(key));
+    ASSERT_EQ(1, d.find(key)->second);
+    ASSERT_EQ(1u, s.count(key));
+    ASSERT_EQ(1, s.find(key)->second);
+    ASSERT_EQ(0u, d.count("pear"));
+    ASSERT_EQ(0u, s.count("pear"));
+}
+
+namespace {
+struct MarkedIdentityHash {
+    typedef void is_avalanching;
+    size_t operator()(uint64_t v) const { return static_cast<size_t>(v); }
+};
+}
+
+TEST(HashTest, IsAvalanchingTrait)
+{
+    static_assert(!google::is_avalanching<std::hash<uint64_t>>::value, "");
+    static_assert(google::is_avalanching<fast_hash<uint64_t>>::value, "");
+    static_assert(google::is_avalanching<fast_hash<std::string>>::value, "");
+    static_assert(google::is_avalanching<MarkedIdentityHash>::value, "");
+}
+
+TEST(HashTest, IdentityHashOfStridedKeysIsFinalized)
+{
+    // With std::hash, keys i << 20 all have the same low bits.  The
+    // table finalizes the hash, so probes stay short and the probe
+    // length limit never makes the table grow early.
+    google::resize_policy policy;
+    policy.max_probe_length = 32;
+    dense_hash_map<uint64_t, int> d;
+    d.set_empty_key(~0ULL);
+    d.set_resize_policy(policy);
+    sparse_hash_map<uint64_t, int> s;
+    s.set_resize_policy(policy);
+    for (uint64_t i = 0; i < 1000; ++i) {
+        d[i << 20] = static_cast<int>(i);
+        s[i << 20] = static_cast<int>(i);
+    }
+    ASSERT_EQ(2048u, d.bucket_count());
+    ASSERT_EQ(2048u, s.bucket_count());
+
+    // A hasher that claims to avalanche is taken at its word.
+    dense_hash_map<uint64_t, int, MarkedIdentityHash> raw;
+    raw.set_empty_key(~0ULL);
+    raw.set_resize_policy(policy);
+    for (uint64_t i = 0; i < 100; ++i)
+        raw[i << 20] = static_cast<int>(i);
+    ASSERT_GT(raw.bucket_count(), 256u);
+}
+
+TEST(HashTest, SeededHashing)
+{
+    dense_hash_map<std::string, int, fast_hash<std::string>> a, b;
+    a.set_empty_key(std::string());
+    b.set_empty_key(std::string());
+    sparse_hash_map<std::string, int, fast_hash<std::string>> s;
+    ASSERT_FALSE(a.seeded_hashing());
+    ASSERT_EQ(0u, a.hash_seed());
+    for (int i = 0; i < 1000; ++i) {
+        a[std::to_string(i)] = i;
+        s[std::to_string(i)] = i;
+    }
+    a.set_seeded_hashing(true);
+    b.set_seeded_hashing(true);
+    s.set_seeded_hashing(true);
+    ASSERT_TRUE(a.seeded_hashing());
+    ASSERT_NE(a.hash_seed(), b.hash_seed());
+    ASSERT_NE(a.hash_seed(), s.hash_seed());
+    for (int i = 0; i < 1000; ++i) {
+        ASSERT_EQ(i, a.find(std::to_string(i))->second);
+        ASSERT_EQ(i, s.find(std::to_string(i))->second);
+    }
+    a.set_hash_seed(b.hash_seed());
+    ASSERT_EQ(a.hash_seed(), b.hash_seed());
+    a.set_seeded_hashing(false);
+    ASSERT_EQ(0u, a.hash_seed());
+    ASSERT_EQ(1000u, a.size());
+    ASSERT_EQ(999, a.find("999")->second);
+}
+
+namespace {
+// Under the first seed it gets, every key collides, as if the keys had
+// been chosen against that seed.  Later seeds hash properly.
+struct FloodedHash {
+    typedef void is_avalanching;
+    FloodedHash() : seeds(0) {}
+    void set_seed(uint64_t) { ++seeds; }
+    size_t operator()(int i) const {
+        return seeds >= 2 ? google::hash_mix64(i) : 0;
+    }
+    int seeds;
+};
+}
+
+TEST(HashTest, SeededHashingReseedsOnLongProbes)
+{
+    dense_hash_map<int, int, FloodedHash> d;
+    d.set_empty_key(-1);
+    d.set_seeded_hashing(true, 16);
+    sparse_hash_map<int, int, FloodedHash> s;
+    s.set_seeded_hashing(true, 16);
+    const uint64_t dense_seed = d.hash_seed();
+    const uint64_t sparse_seed = s.hash_seed();
+    ASSERT_EQ(1, d.hash_funct().seeds);
+
+    for (int i = 0; i < 1000; ++i) {
+        d[i] = i;
+        s[i] = i;
+    }
+    ASSERT_NE(dense_seed, d.hash_seed());
+    ASSERT_NE(sparse_seed, s.hash_seed());
+    // (An unlucky honest probe can reseed again, at 80% full.)
+    ASSERT_GE(d.hash_funct().seeds, 2);
+    ASSERT_GE(s.hash_funct().seeds, 2);
+    ASSERT_EQ(2048u, d.bucket_count());
+    for (int i = 0; i < 1000; ++i) {
+        ASSERT_EQ(i, d[i]);
+        ASSERT_EQ(i, s[i]);
+    }
+}
@@ -6,7 +6,11 @@
 #include "gtest/gtest.h"
 #include <unordered_map>
 #include <unordered_set>
+#include <atomic>
 #include <chrono>
+#include <cstdio>
+#include <sstream>
+#include <vector>
 
 using google::dense_hash_map;
 using google::dense_hash_set;
@@ -829,3 +833,361 @@ TEST(SparseHashMapIfaceTest, TryEmplace)
     ASSERT_EQ(0, A::move_ctor);
     ASSERT_EQ(0, A::move_assign);
 }
+
+TEST(SparseHashMapIfaceTest, FineGrainedBuckets)
+{
+    sparse_hash_map<int, int> h;
+    h.set_deleted_key(-1);
+    h.set_fine_grained_buckets(true);
+
+    for (int i = 0; i < 10000; ++i)
+        h[i] = i;
+    ASSERT_NE(0u, h.bucket_count() & (h.bucket_count() - 1));
+    for (int i = 0; i < 10000; i += 2)
+        ASSERT_EQ(1u, h.erase(i));
+    h.resize(0);  // shrink, rehashing what's left
+
+    ASSERT_EQ(5000u, h.size());
+    for (int i = 0; i < 10000; ++i)
+        ASSERT_EQ(size_t(i % 2), h.count(i));
+}
+
+TEST(SparseHashMapIfaceTest, ResizePolicyMemoryBudget)
+{
+    sparse_hash_map<int, int> h;
+    h.set_deleted_key(-1);
+    google::resize_policy policy;
+    policy.max_bytes = 64 * sizeof(std::pair<const int, int>);
+    h.set_resize_policy(policy);
+
+    for (int i = 0; i < 63; ++i)
+        h[i] = i;
+    ASSERT_EQ(64u, h.bucket_count());
+    ASSERT_THROW(h[63] = 63, std::length_error);
+    h.erase(0);
+    h[63] = 63;
+    ASSERT_EQ(63u, h.size());
+    ASSERT_EQ(63, h[63]);
+}
+
+namespace {
+void count_resize(const google::resize_event& event, void* arg)
+{
+    if (event.done)
+        ++*static_cast<int*>(arg);
+}
+}
+
+TEST(SparseHashMapIfaceTest, ResizeObserver)
+{
+    int rehashes = 0;
+    sparse_hash_map<int, int> h;
+    h.set_deleted_key(-1);
+    h.set_resize_observer(count_resize, &rehashes);
+    for (int i = 0; i < 1000; ++i)
+        h[i] = i;
+    ASSERT_GT(rehashes, 0);
+
+    // serialize() first squashes the deleted entries out.
+    const int before = rehashes;
+    h.erase(5);
+    std::stringstream ss;
+    ASSERT_TRUE(h.serialize(sparse_hash_map<int, int>::NopointerSerializer(), &ss));
+    ASSERT_EQ(before + 1, rehashes);
+}
+
+TEST(SparseHashMapIfaceTest, BufferedSerialize)
+{
+    typedef sparse_hash_map<int, int> Map;
+    Map a, b;
+    for (int i = 0; i < 5000; ++i)
+    {
+        a[i * 3] = i;
+        b[i * 5] = -i;
+    }
+    // Back to back, with something after them that reading mustn't eat.
+    std::stringstream ss;
+    ASSERT_TRUE(a.serialize(Map::NopointerSerializer(), &ss));
+    ASSERT_TRUE(b.serialize(Map::NopointerSerializer(), &ss));
+    ss << "end";
+
+    Map a2, b2;
+    ASSERT_TRUE(a2.unserialize(Map::NopointerSerializer(), &ss));
+    ASSERT_TRUE(b2.unserialize(Map::NopointerSerializer(), &ss));
+    std::string end;
+    ss >> end;
+    ASSERT_EQ("end", end);
+    ASSERT_TRUE(a2 == a);
+    ASSERT_TRUE(b2 == b);
+    ASSERT_EQ(-7, b2[35]);
+}
+
+namespace
+{
+// Writes the key and the length and bytes of the string, to any stream.
+struct StringValueSerializer
+{
+    typedef std::pair<const int, std::string> value_type;
+    template <class OUTPUT>
+    bool operator()(OUTPUT* out, const value_type& v)
+    {
+        return google::sparsehash_internal::write_bigendian_number(out, uint32_t(v.first), 4) &&
+               google::sparsehash_internal::write_bigendian_number(out, uint32_t(v.second.size()), 4) &&
+               google::sparsehash_internal::write_data(out, v.second.data(), v.second.size());
+    }
+    template <class INPUT>
+    bool operator()(INPUT* in, value_type* v)
+    {
+        uint32_t key, length;
+        if (!google::sparsehash_internal::read_bigendian_number(in, &key, 4) ||
+            !google::sparsehash_internal::read_bigendian_number(in, &length, 4))
+            return false;
+        std::string value(length, ' ');
+        if (length && !google::sparsehash_internal::read_data(in, &value[0], length))
+            return false;
+        new (v) value_type(int(key), value);
+        return true;
+    }
+};
+}
+
+TEST(SparseHashMapIfaceTest, ParallelSerialize)
+{
+    sparse_hash_map<int, int> pod;
+    sparse_hash_map<int, std::string> strings;
+    pod.set_deleted_key(-1);
+    strings.set_deleted_key(-1);
+    for (int i = 0; i < 100000; ++i)  // several chunks of groups
+    {
+        pod[i * 3] = i;
+        strings[i * 3] = std::to_string(i);
+    }
+    pod.erase(30);
+    strings.erase(30);
+
+    FILE* pod_file = std::tmpfile();
+    FILE* strings_file = std::tmpfile();
+    ASSERT_TRUE(pod_file && strings_file);
+    ASSERT_TRUE(pod.parallel_serialize(sparse_hash_map<int, int>::NopointerSerializer(),
+                                       fileno(pod_file), 3));
+    ASSERT_TRUE(strings.parallel_serialize(StringValueSerializer(), fileno(strings_file), 2));
+
+    sparse_hash_map<int, int> pod2;
+    sparse_hash_map<int, std::string> strings2;
+    ASSERT_TRUE(pod2.parallel_unserialize(sparse_hash_map<int, int>::NopointerSerializer(),
+                                          fileno(pod_file), 2));
+    ASSERT_TRUE(strings2.parallel_unserialize(StringValueSerializer(), fileno(strings_file), 3));
+    ASSERT_TRUE(pod2 == pod);
+    ASSERT_TRUE(strings2 == strings);
+    ASSERT_EQ(0u, strings2.count(30));
+    ASSERT_EQ("7", strings2[21]);
+    pod2[1] = 1;
+    ASSERT_EQ(pod.size() + 1, pod2.size());
+
+    // The values the other serializer wrote don't add up.
+    ASSERT_FALSE(pod2.parallel_unserialize(sparse_hash_map<int, int>::NopointerSerializer(),
+                                           fileno(strings_file)));
+    std::fclose(pod_file);
+    std::fclose(strings_file);
+}
+
+TEST(SparseHashMapIfaceTest, PrecomputedHash)
+{
+    sparse_hash_map<int, int> h;
+    sparse_hash_set<int> s;
+    h.set_deleted_key(-1);
+    h.set_seeded_hashing(true);
+    for (int i = 0; i < 1000; ++i)
+    {
+        const size_t hash = h.hash_function_value(i);
+        ASSERT_EQ(hash, s.hash_function_value(i));
+        ASSERT_TRUE(h.insert(std::make_pair(i, i), hash).second);
+        ASSERT_TRUE(s.insert(i, hash).second);
+    }
+    for (int i = 0; i < 1000; ++i)
+    {
+        const size_t hash = h.hash_function_value(i);
+        ASSERT_EQ(i, h.find(i, hash)->second);
+        ASSERT_EQ(1u, s.count(i, hash));
+        ASSERT_EQ(h.find(i), h.find(i, hash));
+    }
+    ASSERT_EQ(1u, h.erase(5, h.hash_function_value(5)));
+    ASSERT_EQ(0u, h.count(5, h.hash_function_value(5)));
+    ASSERT_EQ(999u, h.size());
+}
+
+TEST(SparseHashMapIfaceTest, InsertOrMerge)
+{
+    sparse_hash_map<int, int> h;
+    const auto add = [](int& existing, int value) { existing += value; };
+    for (int i = 0; i < 3000; ++i)
+        h.insert_or_merge(i % 1000, 1, add);
+    ASSERT_EQ(1000u, h.size());
+    for (int i = 0; i < 1000; ++i)
+        ASSERT_EQ(3, h[i]);
+
+    sparse_hash_map<int, int>::lookup_handle handle = h.prepare(5000);
+    ASSERT_FALSE(handle.found());
+    ASSERT_EQ(7, handle.emplace(5000, 7)->second);
+    ASSERT_TRUE(h.prepare(5000).found());
+}
+
+namespace {
+// A string key that counts how often it's built from a const char*,
+// with a transparent hasher that looks it up by const char*.
+struct CountedKey
+{
+    static int constructions;
+    std::string s;
+
+    CountedKey() {}
+    CountedKey(const char* p) : s(p) { ++constructions; }
+};
+int CountedKey::constructions = 0;
+
+struct CountedKeyHash
+{
+    using transparent_key_equal = CountedKeyHash;
+    using is_transparent = void;
+
+    size_t operator()(const CountedKey& k) const { return std::hash<std::string>()(k.s); }
+    size_t operator()(const char* p) const { return std::hash<std::string>()(p); }
+    bool operator()(const CountedKey& a, const CountedKey& b) const { return a.s == b.s; }
+    bool operator()(const char* a, const CountedKey& b) const { return b.s == a; }
+    bool operator()(const CountedKey& a, const char* b) const { return a.s == b; }
+};
+
+template <class Map>
+void check_transparent_map(Map& m)
+{
+    m.set_deleted_key("");
+    CountedKey::constructions = 0;
+    m["a"] = 1;
+    m["a"] = 2;
+    ASSERT_EQ(1, CountedKey::constructions);
+    ASSERT_TRUE(m.try_emplace("b", 3).second);
+    ASSERT_FALSE(m.try_emplace("b", 4).second);
+    ASSERT_FALSE(m.try_emplace(m.begin(), "b", 5).second);
+    ASSERT_EQ(2, CountedKey::constructions);
+    ASSERT_EQ(2, m["a"]);
+    ASSERT_EQ(3, m["b"]);
+    ASSERT_EQ(1u, m.erase("a"));
+    ASSERT_EQ(0u, m.erase("a"));
+    ASSERT_EQ(1u, m.size());
+    ASSERT_EQ(2, CountedKey::constructions);
+}
+
+template <class Set>
+void check_transparent_set(Set& s)
+{
+    s.set_deleted_key("");
+    CountedKey::constructions = 0;
+    ASSERT_TRUE(s.insert("a").second);
+    ASSERT_FALSE(s.insert("a").second);
+    ASSERT_EQ(1, CountedKey::constructions);
+    ASSERT_EQ(1u, s.erase("a"));
+    ASSERT_EQ(0u, s.erase("a"));
+    ASSERT_TRUE(s.empty());
+    ASSERT_EQ(1, CountedKey::constructions);
+}
+}
+
+TEST(HashtableTransparentTest, MapsBuildKeysOnlyOnInsert)
+{
+    dense_hash_map<CountedKey, int, CountedKeyHash> dense;
+    dense.set_empty_key("-");
+    check_transparent_map(dense);
+    sparse_hash_map<CountedKey, int, CountedKeyHash> sparse;
+    check_transparent_map(sparse);
+}
+
+TEST(HashtableTransparentTest, SetsBuildKeysOnlyOnInsert)
+{
+    dense_hash_set<CountedKey, CountedKeyHash> dense;
+    dense.set_empty_key("-");
+    check_transparent_set(dense);
+    sparse_hash_set<CountedKey, CountedKeyHash> sparse;
+    check_transparent_set(sparse);
+}
+
+TEST(SparseHashMapIfaceTest, InsertBatch)
+{
+    std::vector<std::pair<int, int>> values;
+    for (int i = 0; i < 1000; ++i)
+        values.push_back(std::make_pair(i % 700, i));
+
+    sparse_hash_map<int, int> h;
+    ASSERT_EQ(700u, h.upsert_batch(values.begin(), values.end()));
+    ASSERT_EQ(700u, h.size());
+    ASSERT_EQ(705, h[5]);
+    ASSERT_EQ(0u, h.insert_batch(values.begin(), values.begin() + 10));
+    ASSERT_EQ(705, h[5]);
+
+    std::vector<int> keys;
+    for (int i = 0; i < 1000; ++i)
+        keys.push_back(i % 300);
+    sparse_hash_set<int> s;
+    ASSERT_EQ(300u, s.insert_batch(keys.begin(), keys.end()));
+    ASSERT_EQ(300u, s.size());
+}
+
+TEST(SparseHashMapIfaceTest, ParallelInsert)
+{
+    std::vector<std::pair<int, int>> values;
+    for (int i = 0; i < 100000; ++i)
+        values.push_back(std::make_pair((i * 7) % 70001, i));
+
+    sparse_hash_map<int, int> parallel, serial;
+    const auto add = [](int& sum, int value) { sum += value; };
+    ASSERT_EQ(70001u, parallel.parallel_upsert(values.begin(), values.end(), add, 4));
+    serial.upsert_batch(values.begin(), values.end(), add);
+    ASSERT_EQ(serial.size(), parallel.size());
+    for (auto it = serial.begin(); it != serial.end(); ++it)
+        ASSERT_EQ(it->second, parallel[it->first]);
+
+    std::vector<int> keys;
+    for (int i = 0; i < 1000; ++i)
+        keys.push_back(i % 300);
+    sparse_hash_set<int> s;
+    ASSERT_EQ(300u, s.parallel_insert(keys.begin(), keys.end()));
+    ASSERT_EQ(300u, s.size());
+}
+
+TEST(SparseHashMapIfaceTest, ParallelSweeps)
+{
+    const int kSize = 200000;  // several PARALLEL_CHUNKs of groups
+    sparse_hash_map<int, int> h;
+    h.set_deleted_key(-1);
+    sparse_hash_set<int> s;
+    s.set_deleted_key(-1);
+    for (int i = 0; i < kSize; ++i) {
+        h[i] = i;
+        s.insert(i);
+    }
+
+    h.parallel_for_each([](std::pair<const int, int>& v) { v.second += 1; }, 4);
+    ASSERT_EQ(124, h[123]);
+    const auto add = [](long long& sum, const std::pair<const int, int>& v) {
+        sum += v.second;
+    };
+    const auto combine = [](long long& sum, const long long& partial) {
+        sum += partial;
+    };
+    ASSERT_EQ((long long)kSize * (kSize + 1) / 2,
+              h.parallel_reduce(0LL, add, combine, 4));
+    ASSERT_EQ(size_t(kSize / 2),
+              h.parallel_erase_if(
+                  [](const std::pair<const int, int>& v) { return v.first % 2; }, 4));
+    ASSERT_EQ(size_t(kSize / 2), h.size());
+    ASSERT_EQ(0u, h.count(7));
+    ASSERT_EQ(9, h[8]);
+
+    std::atomic<int> visited(0);
+    s.parallel_for_each([&visited](const int&) { ++visited; }, 3);
+    ASSERT_EQ(kSize, visited.load());
+    ASSERT_EQ(size_t(kSize - 100),
+              s.parallel_erase_if([](const int& k) { return k >= 100; }));
+    ASSERT_EQ(100u, s.size());
+    ASSERT_EQ(4950, s.parallel_reduce(0, [](int& sum, const int& k) { sum += k; },
+                                      [](int& sum, const int& partial) { sum += partial; }));
+}
@@ -0,0 +1,158 @@
+// The counters are compiled in only with SPARSEHASH_COLLECT_STATS, and
+// the tables here use a hasher of this file's own, so that this file's
+// tables aren't the same types as the (counter-less) ones elsewhere.
+#define SPARSEHASH_COLLECT_STATS 1
+
+#include <sparsehash/dense_hash_map>
+#include <sparsehash/sparse_hash_map>
+
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+using google::dense_hash_map;
+using google::hashtable_counters;
+using google::hashtable_stats;
+using google::sparse_hash_map;
+
+namespace {
+struct StatsHash {
+    size_t operator()(int i) const { return std::hash<int>()(i); }
+};
+// Sends every key to bucket 0.
+struct ConstantHash {
+    typedef void is_avalanching;
+    size_t operator()(int) const { return 0; }
+};
+}
+
+template <class Map>
+static void check_counters(Map& m)
+{
+    for (int i = 0; i < 1000; ++i)
+        m[i] = i;
+    const hashtable_counters& c = m.counters();
+    ASSERT_EQ(1000u, c.inserts);
+    ASSERT_GE(c.lookups, 1000u);
+    ASSERT_GT(c.grows, 0u);
+    ASSERT_EQ(0u, c.shrinks);
+    ASSERT_GT(c.bytes_moved, 0u);
+    uint64_t histogram_total = 0;
+    for (int i = 0; i < google::kProbeHistogramSize; ++i)
+        histogram_total += c.probe_histogram[i];
+    ASSERT_EQ(c.lookups, histogram_total);
+
+    m.reset_counters();
+    ASSERT_EQ(0u, m.counters().lookups);
+    ASSERT_EQ(1u, m.count(5));
+    ASSERT_EQ(1u, m.counters().lookups);
+    ASSERT_EQ(0u, m.counters().inserts);
+
+    for (int i = 0; i < 1000; ++i)
+        m.erase(i);
+    m.resize(0);
+    ASSERT_GT(m.counters().shrinks, 0u);
+}
+
+TEST(HashtableStatsTest, DenseCounters)
+{
+    dense_hash_map<int, int, StatsHash> m;
+    m.set_empty_key(-1);
+    m.set_deleted_key(-2);
+    check_counters(m);
+}
+
+TEST(HashtableStatsTest, SparseCounters)
+{
+    sparse_hash_map<int, int, StatsHash> m;
+    m.set_deleted_key(-2);
+    check_counters(m);
+}
+
+TEST(HashtableStatsTest, ProbeHistogramSlots)
+{
+    ASSERT_EQ(0, google::sparsehash_internal::probe_histogram_slot(0));
+    ASSERT_EQ(1, google::sparsehash_internal::probe_histogram_slot(1));
+    ASSERT_EQ(2, google::sparsehash_internal::probe_histogram_slot(3));
+    ASSERT_EQ(3, google::sparsehash_internal::probe_histogram_slot(4));
+    ASSERT_EQ(google::kProbeHistogramSize - 1,
+              google::sparsehash_internal::probe_histogram_slot(~0ULL));
+}
+
+template <class Map>
+static void check_compute_stats(Map& m)
+{
+    hashtable_stats s = m.compute_stats();
+    ASSERT_EQ(0u, s.size);
+    ASSERT_EQ(0u, s.num_clusters);
+
+    // With every key in one bucket, the keys form one cluster and the
+    // i-th key inserted needs i probes.
+    m.resize(64);
+    for (int i = 0; i < 10; ++i)
+        m[i] = i;
+    m.erase(9);
+    s = m.compute_stats();
+    ASSERT_EQ(9u, s.size);
+    ASSERT_EQ(1u, s.num_deleted);
+    ASSERT_DOUBLE_EQ(1.0 / s.bucket_count, s.tombstone_ratio);
+    ASSERT_DOUBLE_EQ(9.0 / s.bucket_count, s.load_factor);
+    ASSERT_EQ(8u, s.max_displacement);
+    ASSERT_DOUBLE_EQ(4.0, s.mean_displacement);  // (0 + 1 + ... + 8) / 9
+    ASSERT_EQ(1u, s.displacement_histogram[0]);
+    ASSERT_EQ(1u, s.displacement_histogram[1]);
+    ASSERT_EQ(2u, s.displacement_histogram[2]);
+    ASSERT_EQ(4u, s.displacement_histogram[3]);
+    ASSERT_EQ(1u, s.displacement_histogram[4]);
+}
+
+TEST(HashtableStatsTest, DenseComputeStats)
+{
+    dense_hash_map<int, int, ConstantHash> m;
+    m.set_empty_key(-1);
+    m.set_deleted_key(-2);
+    check_compute_stats(m);
+}
+
+TEST(HashtableStatsTest, SparseComputeStats)
+{
+    sparse_hash_map<int, int, ConstantHash> m;
+    m.set_deleted_key(-2);
+    check_compute_stats(m);
+}
+
+TEST(HashtableStatsTest, ClustersWithLinearProbing)
+{
+    // Fine-grained tables probe linearly, so one bucket's keys sit in a
+    // single run.
+    dense_hash_map<int, int, ConstantHash> m;
+    m.set_fine_grained_buckets(true);
+    for (int i = 0; i < 5; ++i)
+        m[i] = i;
+    const hashtable_stats s = m.compute_stats();
+    ASSERT_EQ(1u, s.num_clusters);
+    ASSERT_EQ(5u, s.max_cluster_length);
+    ASSERT_DOUBLE_EQ(5.0, s.mean_cluster_length);
+}
+
+TEST(HashtableStatsTest, ConcurrentConstLookups)
+{
+    dense_hash_map<int, int, StatsHash> m;
+    m.set_empty_key(-1);
+    for (int i = 0; i < 100; ++i)
+        m[i] = i;
+    m.reset_counters();
+    const dense_hash_map<int, int, StatsHash>& readers_view = m;
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 4; ++t) {
+        readers.emplace_back([&readers_view]() {
+            for (int i = 0; i < 10000; ++i)
+                readers_view.count(i % 200);
+        });
+    }
+    for (size_t t = 0; t < readers.size(); ++t)
+        readers[t].join();
+    ASSERT_EQ(40000u, m.counters().lookups);  // none lost
+}
@@ -55,6 +55,8 @@
 #include <typeinfo>  // for class typeinfo (returned by typeid)
 #include <vector>
 #include <type_traits>
+#include <sparsehash/hash>
+#include <sparsehash/packed>
 #include <sparsehash/sparsetable>
 #include "hashtable_test_interface.h"
 #include "fixture_unittests.h"
@@ -140,12 +142,20 @@ class ValueSerializer {
 TEST(HashtableCommonTest, HashMunging) {
   const Hasher hasher;
 
-  // We don't munge the hash value on non-pointer template types.
+  // We munge the hash value on integer template types...
   {
     const sparsehash_internal::sh_hashtable_settings<int, Hasher, size_t, 1>
         settings(hasher, 0.0, 0.0);
     const int v = 1000;
-    EXPECT_EQ(hasher(v), settings.hash(v));
+    EXPECT_NE(hasher(v), settings.hash(v));
+  }
+  // ...but not when the hasher says it avalanches.
+  {
+    const google::fast_hash<int> good_hasher;
+    const sparsehash_internal::sh_hashtable_settings<
+        int, google::fast_hash<int>, size_t, 1> settings(good_hasher, 0.0, 0.0);
+    const int v = 1000;
+    EXPECT_EQ(good_hasher(v), settings.hash(v));
   }
 
   {
@@ -164,6 +174,21 @@ TEST(HashtableCommonTest, HashMunging) {
     v += 0x10000;  // get a non-trivial pointer value
     EXPECT_NE(hasher(v), settings.hash(v));
   }
+  {
+    // A packed key is munged just like the key it holds.
+    const std::hash<uint64_t> plain_hasher;
+    const sparsehash_internal::sh_hashtable_settings<
+        uint64_t, std::hash<uint64_t>, size_t, 1> plain(plain_hasher, 0.0, 0.0);
+    const std::hash<google::packed<uint64_t>> packed_hasher;
+    const sparsehash_internal::sh_hashtable_settings<
+        google::packed<uint64_t>, std::hash<google::packed<uint64_t>>, size_t,
+        1> packed(packed_hasher, 0.0, 0.0);
+    for (uint64_t i = 1; i <= 4; ++i) {
+      const google::packed<uint64_t> v(i << 32);
+      EXPECT_EQ(plain.hash(i << 32), packed.hash(v));
+      EXPECT_NE(packed_hasher(v), packed.hash(v));
+    }
+  }
 }
 
 // ------------------------------------------------------------------------
@@ -1337,9 +1362,9 @@ TYPED_TEST(HashtableAllTest, MetadataSerializationAndEndianness) {
   TypeParam ht_out;
   string kExpectedDense(
       "\x13W\x86"
-      "B\0\0\0\0\0\0\0 \0\0\0\0\0\0\0\0\0\0\0\0",
+      "D\0\0\0\0\0\0\0 \0\0\0\0\0\0\0\0\0\0\0\0",
       24);
-  string kExpectedSparse("$hu1\0\0\0 \0\0\0\0\0\0\0\0\0\0\0\0", 20);
+  string kExpectedSparse("$hu3\0\0\0 \0\0\0\0\0\0\0\0\0\0\0\0", 20);
 
   if (ht_out.supports_readwrite()) {
     auto fp = tmpfile();
@@ -1377,6 +1402,66 @@ TYPED_TEST(HashtableAllTest, MetadataSerializationAndEndianness) {
   }
 }
 
+namespace {
+void AppendBigEndian(string* s, uint64_t value, int length) {
+  for (int i = length - 1; i >= 0; --i)
+    s->push_back(static_cast<char>(value >> (8 * i)));
+}
+}  // unnamed namespace
+
+// Files from before integer hashes were finalized have the old magic
+// numbers and the keys where the identity hash put them.  They still
+// load, and the keys can be found.
+TEST(HashtableTest, UnserializeOldHashOrder) {
+  // Keys 0 to 9 in buckets 0 to 9 of 32, each worth ten times itself.
+  string values;
+  for (int i = 0; i < 10; ++i) {
+    const std::pair<int, int> value(i, 10 * i);
+    values.append(reinterpret_cast<const char*>(&value), sizeof(value));
+  }
+  const size_t first_eight = 8 * sizeof(std::pair<int, int>);
+
+  string dense;
+  AppendBigEndian(&dense, 0x13578642, 4);
+  AppendBigEndian(&dense, 32, 8);
+  AppendBigEndian(&dense, 10, 8);
+  dense.push_back('\xff');  // each byte of bitmap is followed by its values
+  dense.append(values, 0, first_eight);
+  dense.push_back('\x03');
+  dense.append(values, first_eight, string::npos);
+  dense.append(2, '\0');
+
+  string sparse;
+  AppendBigEndian(&sparse, 0x24687531, 4);
+  AppendBigEndian(&sparse, 32, 4);
+  AppendBigEndian(&sparse, 10, 4);
+  AppendBigEndian(&sparse, 10, 2);  // the one group
+  sparse += string("\xff\x03\0\0\0\0", 6);
+  sparse += values;
+
+  std::stringstream dense_stream(dense);
+  dense_hash_map<int, int> dense_map;
+  dense_map.set_empty_key(-1);
+  ASSERT_TRUE(dense_map.unserialize(
+      dense_hash_map<int, int>::NopointerSerializer(), &dense_stream));
+  std::stringstream sparse_stream(sparse);
+  sparse_hash_map<int, int> sparse_map;
+  ASSERT_TRUE(sparse_map.unserialize(
+      sparse_hash_map<int, int>::NopointerSerializer(), &sparse_stream));
+  for (int i = 0; i < 10; ++i) {
+    EXPECT_EQ(1u, dense_map.count(i));
+    EXPECT_EQ(10 * i, dense_map[i]);
+    EXPECT_EQ(1u, sparse_map.count(i));
+    EXPECT_EQ(10 * i, sparse_map[i]);
+  }
+  EXPECT_EQ(10u, dense_map.size());
+  EXPECT_EQ(10u, sparse_map.size());
+
+  // read_metadata() can't rehash, so it refuses them.
+  std::stringstream metadata_stream(sparse);
+  EXPECT_FALSE(sparse_map.read_metadata(&metadata_stream));
+}
+
 // ------------------------------------------------------------------------
 // The above tests test the general API for correctness.  These tests
 // test a few corner cases that have tripped us up in the past, and
@@ -0,0 +1,178 @@
+#include <sparsehash/rcu_dense_hash_map>
+
+#include <atomic>
+#include <chrono>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+using google::dense_hash_map;
+using google::rcu_dense_hash_map;
+
+TEST(RcuDenseHashMap, WritesShowAfterPublish)
+{
+    rcu_dense_hash_map<int, int> map;
+    map.insert_or_assign(1, 10);
+    map.insert_or_assign(2, 20);
+    ASSERT_EQ(2u, map.pending());
+    ASSERT_EQ(0u, map.count(1));
+
+    ASSERT_TRUE(map.publish());
+    ASSERT_FALSE(map.publish());
+    int value = 0;
+    ASSERT_TRUE(map.find(1, &value));
+    ASSERT_EQ(10, value);
+    ASSERT_EQ(2u, map.size());
+
+    map.insert_or_assign(1, 11);
+    map.erase(2);
+    map.insert_or_assign(3, 30);
+    map.erase(3);  // later writes win
+    map.publish();
+    ASSERT_TRUE(map.find(1, &value));
+    ASSERT_EQ(11, value);
+    ASSERT_FALSE(map.find(2, &value));
+    ASSERT_EQ(0u, map.count(3));
+    ASSERT_EQ(1, map.read([](const dense_hash_map<int, int>& m) {
+        return static_cast<int>(m.size());
+    }));
+}
+
+// Its copy assignment throws while fail is set.
+struct ThrowingAssign {
+    static std::atomic<bool> fail;
+    ThrowingAssign() : value(0) {}
+    explicit ThrowingAssign(int v) : value(v) {}
+    ThrowingAssign(const ThrowingAssign&) = default;
+    ThrowingAssign(ThrowingAssign&&) = default;
+    ThrowingAssign& operator=(ThrowingAssign&&) = default;
+    ThrowingAssign& operator=(const ThrowingAssign& other) {
+        if (fail) throw std::runtime_error("assign");
+        value = other.value;
+        return *this;
+    }
+    int value;
+};
+std::atomic<bool> ThrowingAssign::fail(false);
+
+TEST(RcuDenseHashMap, FailedPublishRequeues)
+{
+    rcu_dense_hash_map<int, ThrowingAssign> map;
+    map.insert_or_assign(1, ThrowingAssign(10));
+    map.insert_or_assign(2, ThrowingAssign(20));
+    ThrowingAssign::fail = true;
+    ASSERT_THROW(map.publish(), std::runtime_error);
+    ThrowingAssign::fail = false;
+    ASSERT_EQ(0u, map.size());
+    ASSERT_EQ(2u, map.pending());
+
+    map.insert_or_assign(1, ThrowingAssign(11));  // after the requeued ones
+    ASSERT_TRUE(map.publish());
+    ThrowingAssign value;
+    ASSERT_TRUE(map.find(1, &value));
+    ASSERT_EQ(11, value.value);
+    ASSERT_TRUE(map.find(2, &value));
+    ASSERT_EQ(20, value.value);
+}
+
+TEST(RcuDenseHashMap, InitialSnapshotAndThreshold)
+{
+    dense_hash_map<int, int> initial;
+    initial.set_empty_key(-1);
+    initial.set_deleted_key(-2);
+    initial[7] = 70;
+    rcu_dense_hash_map<int, int> map(initial);
+    ASSERT_EQ(1u, map.count(7));
+
+    map.set_publish_threshold(3);
+    map.insert_or_assign(8, 80);
+    map.erase(7);
+    ASSERT_EQ(1u, map.count(7));
+    map.insert_or_assign(9, 90);  // the third write publishes
+    ASSERT_EQ(0u, map.pending());
+    ASSERT_EQ(0u, map.count(7));
+    ASSERT_EQ(2u, map.size());
+}
+
+TEST(RcuDenseHashMap, BackgroundPublisher)
+{
+    rcu_dense_hash_map<int, int> map;
+    map.start_publisher(std::chrono::milliseconds(1));
+    map.insert_or_assign(1, 1);
+    for (int i = 0; i < 5000 && map.count(1) == 0; ++i)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    ASSERT_EQ(1u, map.count(1));
+    map.stop_publisher();
+}
+
+TEST(RcuDenseHashMap, BackgroundPublisherSurvivesErrors)
+{
+    rcu_dense_hash_map<int, ThrowingAssign> map;
+    ThrowingAssign::fail = true;
+    map.start_publisher(std::chrono::milliseconds(1));
+    map.insert_or_assign(1, ThrowingAssign(10));
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    ASSERT_EQ(0u, map.count(1));
+    ThrowingAssign::fail = false;  // the next publish gets it through
+    for (int i = 0; i < 5000 && map.count(1) == 0; ++i)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    ASSERT_EQ(1u, map.count(1));
+    map.stop_publisher();
+}
+
+TEST(RcuDenseHashMap, WritesInsideRead)
+{
+    rcu_dense_hash_map<int, int> map;
+    map.set_publish_threshold(1);
+    map.read([&map](const dense_hash_map<int, int>&) {
+        map.insert_or_assign(1, 10);  // would wait for this reader
+        return 0;
+    });
+    ASSERT_EQ(1u, map.pending());
+    map.insert_or_assign(2, 20);  // outside, it publishes
+    ASSERT_EQ(0u, map.pending());
+    ASSERT_EQ(2u, map.size());
+}
+
+TEST(RcuDenseHashMap, ReadersSeeWholeSnapshots)
+{
+    // Each publish sets every key to the same version; a reader must
+    // never see two versions in one snapshot.
+    const int kKeys = 100;
+    const int kVersions = 200;
+    rcu_dense_hash_map<int, int> map;
+    for (int k = 0; k < kKeys; ++k)
+        map.insert_or_assign(k, 0);
+    map.publish();
+
+    std::atomic<bool> done(false);
+    std::atomic<bool> torn(false);
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 4; ++t) {
+        readers.push_back(std::thread([&]() {
+            while (!done) {
+                const bool same = map.read([&](const dense_hash_map<int, int>& m) {
+                    const int version = m.find(0)->second;
+                    for (int k = 1; k < kKeys; ++k)
+                        if (m.find(k)->second != version) return false;
+                    return true;
+                });
+                if (!same) torn = true;
+            }
+        }));
+    }
+    for (int v = 1; v <= kVersions; ++v) {
+        for (int k = 0; k < kKeys; ++k)
+            map.insert_or_assign(k, v);
+        map.publish();
+    }
+    done = true;
+    for (size_t t = 0; t < readers.size(); ++t)
+        readers[t].join();
+    ASSERT_FALSE(torn);
+    int value = 0;
+    ASSERT_TRUE(map.find(kKeys - 1, &value));
+    ASSERT_EQ(kVersions, value);
+}
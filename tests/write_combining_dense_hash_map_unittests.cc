@@ -0,0 +1,129 @@
+#include <sparsehash/write_combining_dense_hash_map>
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+using google::dense_hash_map;
+using google::write_combining_dense_hash_map;
+
+TEST(WriteCombiningDenseHashMap, BufferFlushes)
+{
+    write_combining_dense_hash_map<int, int> map;
+    write_combining_dense_hash_map<int, int>::buffer buf(&map, 3);
+    buf.add(1, 1);
+    buf.add(1, 2);
+    buf.add(2, 5);
+    ASSERT_EQ(2u, buf.size());
+    ASSERT_TRUE(map.empty());  // nothing flushed yet
+
+    buf.add(3, 1);  // the third key fills the buffer
+    ASSERT_TRUE(buf.empty());
+    ASSERT_EQ(3u, map.size());
+    int value = 0;
+    ASSERT_TRUE(map.find(1, &value));
+    ASSERT_EQ(3, value);
+
+    buf.add(1, 10);
+    map.add(2, 100);  // unbuffered
+    ASSERT_EQ(0u, buf.flush());  // no new keys
+    ASSERT_EQ(0u, buf.flush());
+    ASSERT_TRUE(map.find(1, &value));
+    ASSERT_EQ(13, value);
+    ASSERT_TRUE(map.find(2, &value));
+    ASSERT_EQ(105, value);
+}
+
+TEST(WriteCombiningDenseHashMap, FlushesOnDestruction)
+{
+    dense_hash_map<std::string, int> initial;
+    initial.set_empty_key("");
+    initial["a"] = 1;
+    write_combining_dense_hash_map<std::string, int> map(initial);
+    {
+        write_combining_dense_hash_map<std::string, int>::buffer buf(&map);
+        buf.add("a", 1);
+        buf.add("b", 1);
+        ASSERT_EQ(1u, map.size());
+    }
+    ASSERT_EQ(2u, map.size());
+    ASSERT_EQ(2, map.read([](const dense_hash_map<std::string, int>& m) {
+        return m.find("a")->second;
+    }));
+}
+
+struct KeepMax {
+    void operator()(int& into, const int& value) const {
+        into = std::max(into, value);
+    }
+};
+
+TEST(WriteCombiningDenseHashMap, CustomCombine)
+{
+    write_combining_dense_hash_map<int, int, KeepMax> map;
+    write_combining_dense_hash_map<int, int, KeepMax>::buffer buf(&map);
+    buf.add(1, 5);
+    buf.add(1, 3);
+    buf.flush();
+    buf.add(1, 4);
+    buf.add(1, 7);
+    buf.flush();
+    int value = 0;
+    ASSERT_TRUE(map.find(1, &value));
+    ASSERT_EQ(7, value);
+}
+
+struct ThrowOnNegative {
+    void operator()(int& into, const int& value) const {
+        if (value < 0) throw std::runtime_error("negative");
+        into += value;
+    }
+};
+
+TEST(WriteCombiningDenseHashMap, DestructorSwallowsFlushErrors)
+{
+    write_combining_dense_hash_map<int, int, ThrowOnNegative> map;
+    map.add(1, 10);
+    {
+        write_combining_dense_hash_map<int, int, ThrowOnNegative>::buffer buf(&map);
+        buf.add(1, -1);
+        ASSERT_THROW(buf.flush(), std::runtime_error);
+        buf.add(2, 5);  // the failed update is still buffered
+    }  // flushing again throws, and the updates are dropped
+    int value = 0;
+    ASSERT_TRUE(map.find(1, &value));
+    ASSERT_EQ(10, value);
+    map.add(1, 1);  // the lock was let go
+    ASSERT_TRUE(map.find(1, &value));
+    ASSERT_EQ(11, value);
+}
+
+TEST(WriteCombiningDenseHashMap, ConcurrentCounting)
+{
+    const int kThreads = 8;
+    const int kEvents = 20000;
+    const int kKeys = 100;
+    write_combining_dense_hash_map<int, long> map;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreads; ++t) {
+        threads.emplace_back([&map, t]() {
+            write_combining_dense_hash_map<int, long>::buffer buf(&map, 16);
+            for (int i = 0; i < kEvents; ++i) buf.add((i + t) % kKeys, 1);
+        });
+    }
+    for (size_t i = 0; i < threads.size(); ++i) threads[i].join();
+
+    ASSERT_EQ(static_cast<size_t>(kKeys), map.size());
+    long total = 0;
+    for (int key = 0; key < kKeys; ++key) {
+        long value = 0;
+        ASSERT_TRUE(map.find(key, &value));
+        ASSERT_EQ(static_cast<long>(kThreads * kEvents / kKeys), value);
+        total += value;
+    }
+    ASSERT_EQ(static_cast<long>(kThreads) * kEvents, total);
+}